@@ -0,0 +1,361 @@
+// liu_bench: microbenchmarks for the corpus and scoring paths of v2.
+//
+// Every benchmark is calibrated to a minimum run time, run a few times as
+// warmup, then repeated; the table reports per-iteration time statistics over
+// the repetitions. Corpus dependent benchmarks run once per corpus size.
+
+#include "v2.hpp"
+
+#include <unistd.h>
+
+#ifndef LIU_LAYOUT_DIR
+#define LIU_LAYOUT_DIR "../layouts"
+#endif
+
+struct BenchConfig {
+    double min_time = 0.1; // seconds per repetition
+    int warmup = 1;
+    int repetitions = 5;
+    std::string filter;
+    std::string text; // corpus source, synthetic text when empty
+    std::string layout = LIU_LAYOUT_DIR "/semimak";
+    std::string weights; // scoring weights file, SFB only when empty
+    std::vector<std::size_t> sizes = {64 << 10, 1 << 20, 16 << 20};
+};
+
+struct BenchSummary {
+    std::uint64_t iterations = 0;
+    double mean = 0; // nanoseconds per iteration
+    double median = 0;
+    double stddev = 0;
+    double min = 0;
+};
+
+// Removes the scratch corpus file however the run ends.
+struct TempFile {
+    std::filesystem::path path;
+
+    ~TempFile() {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+};
+
+template <typename T>
+inline void do_not_optimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+template <typename Body>
+double time_batch(Body &body, std::uint64_t iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for (std::uint64_t i = 0; i < iterations; i++) body();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+template <typename Body>
+BenchSummary run_benchmark(const BenchConfig &config, Body &&body) {
+    // grow the batch until one repetition takes at least min_time
+    std::uint64_t iterations = 1;
+    double elapsed = time_batch(body, iterations);
+    while (elapsed < config.min_time && iterations < (std::uint64_t{1} << 40)) {
+        double scale = elapsed > 0 ? config.min_time / elapsed * 1.2 : 10;
+        iterations = std::max(iterations + 1, static_cast<std::uint64_t>(iterations * std::min(scale, 10.0)));
+        elapsed = time_batch(body, iterations);
+    }
+
+    for (int i = 0; i < config.warmup; i++) time_batch(body, iterations);
+
+    std::vector<double> samples;
+    for (int i = 0; i < config.repetitions; i++) {
+        samples.push_back(time_batch(body, iterations) * 1e9 / iterations);
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchSummary summary;
+    summary.iterations = iterations;
+    summary.min = samples.front();
+    std::size_t mid = samples.size() / 2;
+    summary.median = samples.size() % 2 ? samples[mid] : (samples[mid - 1] + samples[mid]) / 2;
+    for (double sample : samples) summary.mean += sample;
+    summary.mean /= samples.size();
+    for (double sample : samples) summary.stddev += (sample - summary.mean) * (sample - summary.mean);
+    summary.stddev = samples.size() > 1 ? std::sqrt(summary.stddev / (samples.size() - 1)) : 0;
+    return summary;
+}
+
+std::string format_time(double ns) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(ns < 10 ? 2 : ns < 1000 ? 1 : 0) << ns << " ns";
+    return out.str();
+}
+
+std::string format_size(std::size_t bytes) {
+    if (bytes >= (1 << 20) && bytes % (1 << 20) == 0) return std::to_string(bytes >> 20) + "MiB";
+    if (bytes >= (1 << 10) && bytes % (1 << 10) == 0) return std::to_string(bytes >> 10) + "KiB";
+    return std::to_string(bytes) + "B";
+}
+
+void print_header() {
+    std::cout << std::left << std::setw(32) << "benchmark" << std::right
+              << std::setw(12) << "iterations" << std::setw(14) << "mean" << std::setw(14) << "median"
+              << std::setw(14) << "stddev" << std::setw(14) << "min" << std::setw(8) << "cv"
+              << std::setw(12) << "throughput" << "\n";
+}
+
+// Runs body under name unless the filter excludes it. bytes is the input
+// consumed per iteration, for a throughput column.
+template <typename Body>
+void bench(const BenchConfig &config, const std::string &name, Body &&body, std::size_t bytes = 0) {
+    if (!config.filter.empty() && name.find(config.filter) == std::string::npos) return;
+
+    BenchSummary summary = run_benchmark(config, body);
+
+    std::cout << std::left << std::setw(32) << name << std::right
+              << std::setw(12) << summary.iterations
+              << std::setw(14) << format_time(summary.mean)
+              << std::setw(14) << format_time(summary.median)
+              << std::setw(14) << format_time(summary.stddev)
+              << std::setw(14) << format_time(summary.min);
+
+    std::ostringstream cv;
+    cv << std::fixed << std::setprecision(1) << (summary.mean > 0 ? summary.stddev / summary.mean * 100 : 0) << "%";
+    std::cout << std::setw(8) << cv.str();
+
+    if (bytes > 0) {
+        std::ostringstream rate;
+        rate << std::fixed << std::setprecision(0) << bytes / summary.median * 1e3 << " MB/s";
+        std::cout << std::setw(12) << rate.str();
+    }
+    std::cout << "\n";
+}
+
+// Deterministic English-like text: words drawn with a Zipf-like bias from a
+// fixed list, with occasional punctuation, so every run counts the same bytes.
+std::string synthetic_text(std::size_t size) {
+    static constexpr std::string_view words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be",
+        "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have",
+        "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", "has",
+        "there", "been", "if", "more", "when", "will", "would", "who", "so", "no", "program",
+        "software", "license", "keyboard", "quickly", "jumped", "over", "lazy", "brown", "fox",
+        "zephyr", "quixotic", "wizard", "javelin", "vex", "kayak", "question", "example",
+    };
+    constexpr std::size_t word_count = std::size(words);
+
+    std::mt19937_64 rng(0x6c6975);
+    std::string text;
+    text.reserve(size + 16);
+
+    while (text.size() < size) {
+        std::size_t rank = std::min<std::size_t>(rng() % word_count, rng() % word_count);
+        text += words[rank];
+
+        std::uint64_t roll = rng() % 32;
+        if (roll == 0) text += ".";
+        else if (roll == 1) text += ",";
+        else if (roll == 2) text += "'s";
+        text += roll == 3 ? "\n" : " ";
+    }
+
+    text.resize(size);
+    return text;
+}
+
+// size bytes of corpus text: a prefix of the --text file, repeated if it is
+// shorter, or synthetic text.
+std::optional<std::string> corpus_text(const BenchConfig &config, std::size_t size) {
+    if (config.text.empty()) return synthetic_text(size);
+
+    std::ifstream in(config.text, std::ios::binary);
+    std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!in && !in.eof()) return std::nullopt;
+    if (source.empty()) return std::nullopt;
+
+    std::string text;
+    text.reserve(size);
+    while (text.size() < size) text.append(source, 0, std::min(source.size(), size - text.size()));
+    return text;
+}
+
+bool parse_bench_options(int argc, char **argv, BenchConfig &config) {
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string_view value = argv[++i];
+
+        bool valid = true;
+        if (arg == "--filter") config.filter = value;
+        else if (arg == "--text") config.text = value;
+        else if (arg == "--layout") config.layout = value;
+        else if (arg == "--weights") config.weights = value;
+        else if (arg == "--min-time") valid = parse_number(value, config.min_time);
+        else if (arg == "--warmup") valid = parse_number(value, config.warmup);
+        else if (arg == "--repetitions") valid = parse_number(value, config.repetitions) && config.repetitions > 0;
+        else if (arg == "--sizes") {
+            config.sizes.clear();
+            std::string_view rest = value;
+            while (valid && !rest.empty()) {
+                std::size_t comma = rest.find(',');
+                std::size_t kib = 0;
+                valid = parse_number(rest.substr(0, comma), kib) && kib > 0;
+                config.sizes.push_back(kib << 10);
+                rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+            }
+            valid = valid && !config.sizes.empty();
+        }
+        else valid = false;
+
+        if (!valid) return false;
+    }
+    return config.min_time > 0 && config.warmup >= 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!parse_bench_options(argc, argv, config)) {
+        std::cerr << "usage: liu_bench [--filter SUBSTRING] [--text PATH] [--layout PATH]\n"
+                     "                 [--weights FILE] [--sizes KIB,KIB,...] [--min-time SECONDS]\n"
+                     "                 [--warmup N] [--repetitions N]\n";
+        return 1;
+    }
+
+    auto base_layout = load_layout_file(config.layout);
+    if (!base_layout) {
+        std::cerr << config.layout << ": " << error_message(base_layout.error()) << "\n";
+        return 1;
+    }
+
+    if (!config.weights.empty()) {
+        auto weights = load_weights(config.weights);
+        if (!weights) {
+            std::cerr << config.weights << ": " << error_message(weights.error()) << "\n";
+            return 1;
+        }
+        scoring = make_kernel(*weights);
+    }
+
+    const Alphabet alphabet = layout_alphabet(alpha_chars(*base_layout));
+    const TempFile corpus_file{std::filesystem::temp_directory_path() /
+                               ("liu_bench_" + std::to_string(getpid()) + ".liu")};
+
+    std::cout << "repetitions " << config.repetitions << ", warmup " << config.warmup
+              << ", min time " << config.min_time << " s\n";
+    print_header();
+
+    bench(config, "geometry/build", [] {
+        auto built = std::make_unique<Geometry>(build_geometry());
+        do_not_optimize(built->same_finger[0]);
+    });
+
+    for (std::size_t size : config.sizes) {
+        auto text = corpus_text(config, size);
+        if (!text) {
+            std::cerr << config.text << ": " << error_message(CORPUS_ERROR_INVALID_FILE) << "\n";
+            return 1;
+        }
+        std::string suffix = "/" + format_size(size);
+
+        std::unique_ptr<NgramTables> tables;
+        bench(config, "corpus/count" + suffix, [&] {
+            tables = build_ngram_tables(*text, alphabet);
+            do_not_optimize(tables->bigrams[0]);
+        }, size);
+        if (!tables) tables = build_ngram_tables(*text, alphabet);
+
+        if (!write_corpus(corpus_file.path.string(), *tables)) {
+            std::cerr << corpus_file.path.string() << ": " << error_message(CORPUS_ERROR_INVALID_FILE) << "\n";
+            return 1;
+        }
+        bench(config, "corpus/load" + suffix, [&] {
+            auto mapped = map_corpus(corpus_file.path.string());
+            do_not_optimize(mapped.has_value());
+        });
+
+        KeyboardLayout layout = *base_layout;
+        CompactLayout compact = to_compact(layout, alphabet);
+        PlacedTotals totals = placed_totals(compact.positions, *tables);
+
+        // v2 reports hand and finger usage inside get_stats; get_sfb is the
+        // score on its own
+        bench(config, "get_sfb" + suffix, [&] {
+            do_not_optimize(get_sfb(compact.positions, *tables));
+        });
+        bench(config, "score_layout" + suffix, [&] {
+            do_not_optimize(score_layout(compact.positions, *tables));
+        });
+        bench(config, "get_stats" + suffix, [&] {
+            LayoutStats stats = get_stats(compact.positions, *tables);
+            do_not_optimize(stats);
+        });
+        bench(config, "get_stats/layout" + suffix, [&] {
+            LayoutStats stats = get_stats(layout, *tables);
+            do_not_optimize(stats);
+        });
+        // a partial metric set pays for the trigram pass but not the unused classes
+        bench(config, "evaluate/sfb_sfs_rolls" + suffix, [&] {
+            LayoutStats stats = Evaluator<SFB, SFS, Rolls>::evaluate(compact.positions, *tables);
+            do_not_optimize(stats);
+        });
+
+        std::uint8_t id1 = alphabet.id('e');
+        std::uint8_t id2 = alphabet.id('t');
+        bench(config, "swap_delta" + suffix, [&] {
+            do_not_optimize(swap_delta(compact.positions, *tables, totals, id1, id2));
+        });
+
+        // every swap between two placed characters, as one neighbourhood scan
+        std::vector<std::uint8_t> ids = movable_ids(compact.positions, alphabet);
+        bench(config, "swap_delta/all_pairs" + suffix, [&] {
+            double best = std::numeric_limits<double>::max();
+            for (std::size_t i = 0; i < ids.size(); i++) {
+                for (std::size_t j = i + 1; j < ids.size(); j++) {
+                    best = std::min(best, swap_delta(compact.positions, *tables, totals, ids[i], ids[j]));
+                }
+            }
+            do_not_optimize(best);
+        });
+
+        ServeRequest request{};
+        request.op = SERVE_OP_EVALUATE;
+        for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+            std::uint8_t id = compact.keys[pos];
+            request.keys[pos] = id == NO_CHAR ? '\0' : alphabet.chars[id];
+        }
+        bench(config, "serve_request" + suffix, [&] {
+            ServeResponse response = serve_request(request, *tables);
+            do_not_optimize(response);
+        });
+
+        bench(config, "gen_layout" + suffix, [&] {
+            KeyboardLayout generated = gen_layout(layout, *tables);
+            do_not_optimize(generated.score);
+        });
+        bench(config, "descend" + suffix, [&] {
+            ChainResult descended = descend(compact, *tables);
+            do_not_optimize(descended.score);
+        });
+        bench(config, "swap_table" + suffix, [&] {
+            SwapTable table = make_swap_table(compact, ids, *tables);
+            do_not_optimize(table.delta);
+        });
+    }
+
+    // scoring independent of the corpus
+    CompactLayout compact = to_compact(*base_layout, alphabet);
+    std::uint8_t id1 = alphabet.id('e');
+    std::uint8_t id2 = alphabet.id('t');
+    bench(config, "swap_keys/compact", [&] {
+        swap_keys(compact, id1, id2);
+        do_not_optimize(compact);
+    });
+
+    KeyboardLayout layout = *base_layout;
+    bench(config, "swap_keys/layout", [&] {
+        swap_keys(layout, 'e', 't');
+        do_not_optimize(layout.char_to_key);
+    });
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "v2.hpp"
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && std::string_view(argv[1]) == "corpus") {
+        return compile_corpus(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && std::string_view(argv[1]) == "batch") {
+        return batch_command(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && std::string_view(argv[1]) == "serve") {
+        return serve_command(argc - 1, argv + 1);
+    }
+
+    auto options = parse_options(argc, argv);
+    if (!options) {
+        print_usage();
+        return 1;
+    }
+    if (!use_weights(*options)) return 1;
+
+    auto base_layout = load_layout(options->layout);
+    if (!base_layout) {
+        std::cerr << "could not load layout " << options->layout << "\n";
+        return 1;
+    }
+
+    auto corpus = load_corpus(*options, alpha_chars(*base_layout));
+    if (!corpus) return 1;
+    const NgramTables *tables = corpus->tables;
+
+    if (std::string unscored = unscored_chars(*base_layout, tables->alphabet); !unscored.empty()) {
+        std::cerr << options->layout << ": " << error_message(LAYOUT_ERROR_UNSCORED_CHARS) << " (" << unscored
+                  << ")\n";
+        return 1;
+    }
+
+    LayoutStats base_stats = get_stats(*base_layout, *tables);
+    base_layout->print();
+    base_stats.print();
+    
+    KeyboardLayout optimized_layout = static_cast<KeyboardLayout>(*base_layout); 
+
+    // the search starts from the closest layout the constraints allow
+    Constraints constraints;
+    if (!options->constraints.empty()) {
+        CompactLayout start = to_compact(*base_layout, tables->alphabet);
+        auto loaded = load_constraints(options->constraints, start, tables->alphabet);
+        auto moved = loaded ? repair_layout(start, *loaded, tables->alphabet)
+                            : std::expected<std::size_t, Error>(std::unexpected(loaded.error()));
+        if (!moved) {
+            std::cerr << options->constraints << ": " << error_message(moved.error()) << "\n";
+            return 1;
+        }
+        if (*moved > 0) {
+            apply_layout(optimized_layout, start, tables->alphabet);
+            std::cout << *moved << " characters moved to satisfy the constraints\n";
+        }
+        constraints = *loaded;
+    }
+
+    std::unique_ptr<ScoreCache> cache;
+    if (options->cache > 0) cache = std::make_unique<ScoreCache>(options->cache);
+    
+    auto start = std::chrono::high_resolution_clock::now();
+    if (options->mode == "parallel") {
+        auto best = parallel_layouts(optimized_layout, *tables, options->anneal, options->parallel, constraints,
+                                     cache.get());
+
+        auto end = std::chrono::high_resolution_clock::now();
+        for (KeyboardLayout &layout : best) {
+            LayoutStats stats = get_stats(layout, *tables);
+            layout.print();
+            stats.print();
+            std::cout << "\n";
+        }
+        std::cout << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() << " ns\n";
+        if (cache) print_cache_stats(*cache);
+        return 0;
+    }
+
+    if (options->mode == "anneal") {
+        optimized_layout = anneal_layout(optimized_layout, *tables, options->anneal, constraints, cache.get());
+    } else if (options->mode == "steepest") {
+        optimized_layout = steepest_layout(optimized_layout, *tables, constraints);
+    } else if (options->mode == "tabu") {
+        optimized_layout = tabu_layout(optimized_layout, *tables, options->tabu, constraints);
+    } else if (options->mode == "genetic") {
+        optimized_layout = genetic_layout(optimized_layout, *tables, options->genetic, constraints, cache.get());
+    } else if (options->mode == "exact") {
+        auto result = exact_search(to_compact(optimized_layout, tables->alphabet), *tables, options->exact,
+                                   constraints);
+        if (!result) {
+            std::cerr << "exact: " << error_message(result.error()) << "\n";
+            return 1;
+        }
+        apply_layout(optimized_layout, result->best.layout, tables->alphabet);
+        std::cout << result->nodes << " nodes searched\n";
+    } else {
+        optimized_layout = gen_layout(optimized_layout, *tables, constraints);
+    }
+    LayoutStats optimized_stats = get_stats(optimized_layout, *tables);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+    optimized_layout.print(); 
+    optimized_stats.print();
+
+
+    std::cout << duration.count() << " ns\n"; 
+    if (cache) print_cache_stats(*cache);
+    
+    return 0;
+}
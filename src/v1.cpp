@@ -47,16 +47,23 @@ std::string finger_name(Finger f) {
     }
 }
 
-namespace std {
-    template<>
-    struct hash<std::tuple<Finger, Finger, Finger>> {
-        size_t operator()(const std::tuple<Finger, Finger, Finger>& t) const noexcept {
-            auto h1 = static_cast<std::uint8_t>(std::get<0>(t));
-            auto h2 = static_cast<std::uint8_t>(std::get<1>(t));
-            auto h3 = static_cast<std::uint8_t>(std::get<2>(t));
-            return ((std::hash<uint8_t>{}(h1) << 16) ^ (std::hash<uint8_t>{}(h2) << 8) ^ (std::hash<uint8_t>{}(h3)));
-        }
-    };
+enum class Trigram : std::uint8_t {
+    UNKNOWN = 0, ALTERNATE, ROLL_IN, ROLL_OUT, ONEH_IN, ONEH_OUT,
+    REDIRECT, BAD_REDIRECT, DSFB_RED, DSFB_ALT,
+    COUNT,
+};
+
+Trigram string_to_trigram(std::string_view type) {
+    if (type == "alternate") return Trigram::ALTERNATE;
+    if (type == "roll-in") return Trigram::ROLL_IN;
+    if (type == "roll-out") return Trigram::ROLL_OUT;
+    if (type == "oneh-in") return Trigram::ONEH_IN;
+    if (type == "oneh-out") return Trigram::ONEH_OUT;
+    if (type == "redirect") return Trigram::REDIRECT;
+    if (type == "bad-redirect") return Trigram::BAD_REDIRECT;
+    if (type == "dsfb-red") return Trigram::DSFB_RED;
+    if (type == "dsfb-alt") return Trigram::DSFB_ALT;
+    return Trigram::UNKNOWN;
 }
 
 enum class Hand : std::uint8_t {
@@ -102,13 +109,36 @@ struct KeyboardLayout {
     }
 };
 
+// N-gram counts of a corpus, lowercased at load time. Monograms and bigrams are
+// dense tables indexed by byte; trigrams are sparse, sorted by packed gram.
+// After loading, monograms, bigrams and trigram_counts keep only the grams a
+// metric can count: nonzero, and for bigrams and trigrams without spaces
+// (bigrams also without repeated letters).
 struct CorpusData {
     std::string corpus_name;
-    std::unordered_map<char, int> monogram_counts;
-    std::unordered_map<std::string, int> bigram_counts;
-    std::unordered_map<std::string, int> trigram_counts;
+    std::array<int, 256> monogram_counts{};
+    std::vector<int> bigram_counts = std::vector<int>(256 * 256);
+    std::vector<std::pair<std::uint32_t, int>> trigram_counts;
+
+    std::vector<std::pair<unsigned char, int>> monograms;
+    std::vector<std::pair<std::uint16_t, int>> bigrams;
+
+    double total_bigrams = 0;
+    double total_trigrams = 0;
+
+    int bigram(unsigned char first, unsigned char second) const {
+        return bigram_counts[first * 256 + second];
+    }
 };
 
+constexpr std::uint32_t pack_trigram(unsigned char a, unsigned char b, unsigned char c) {
+    return (std::uint32_t(a) << 16) | (std::uint32_t(b) << 8) | c;
+}
+
+unsigned char to_lower(char c) {
+    return static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(c)));
+}
+
 struct LayoutStats {
     std::string corpus_name;
 
@@ -148,7 +178,14 @@ struct LayoutStats {
     }
 };
 
-std::unordered_map<std::tuple<Finger, Finger, Finger>, std::string> combo_table;
+constexpr int FINGER_COUNT = 11;
+
+constexpr int combo_index(Finger f1, Finger f2, Finger f3) {
+    return (static_cast<int>(f1) * FINGER_COUNT + static_cast<int>(f2)) * FINGER_COUNT + static_cast<int>(f3);
+}
+
+// Trigram type of every finger triple, filled from combo_table.json at startup.
+std::array<Trigram, FINGER_COUNT * FINGER_COUNT * FINGER_COUNT> combo_table{};
 
 Finger get_finger(int col, Hand hand) {
     if(hand == Hand::LEFT) {
@@ -262,7 +299,6 @@ void parse_combo_table(const simdjson::padded_string& json_data) {
         std::string_view key = field.unescaped_key();
         std::string_view value = field.value().get_string();
         std::string key_str(key);
-        std::string value_str(value);
 
         std::array<std::string, 3> finger_codes = {
             key_str.substr(0, 2),
@@ -274,7 +310,7 @@ void parse_combo_table(const simdjson::padded_string& json_data) {
         Finger finger2 = string_to_finger(finger_codes[1]);
         Finger finger3 = string_to_finger(finger_codes[2]);
 
-        combo_table[std::make_tuple(finger1, finger2, finger3)] = value_str;
+        combo_table[combo_index(finger1, finger2, finger3)] = string_to_trigram(value);
     }
 }
 
@@ -285,7 +321,7 @@ void load_combo_table() {
     }
 }
 
-void parse_ngram_counts(const simdjson::padded_string& json_data, std::unordered_map<std::string, int>& map, int ngram_length) {
+void parse_bigram_counts(const simdjson::padded_string& json_data, CorpusData& data) {
     simdjson::ondemand::parser parser;
     auto doc = parser.iterate(json_data);
     
@@ -293,14 +329,39 @@ void parse_ngram_counts(const simdjson::padded_string& json_data, std::unordered
         std::string_view key = field.unescaped_key();
         int value = field.value().get_int64();
         
-        std::string key_str(key);
-        if(key_str.length() == ngram_length) {
-            map[key_str] = value;
+        if(key.length() == 2) {
+            data.bigram_counts[to_lower(key[0]) * 256 + to_lower(key[1])] += value;
+            data.total_bigrams += value;
         }
     }
 }
 
-void parse_monogram_counts(const simdjson::padded_string& json_data, std::unordered_map<char, int>& map) {
+void parse_trigram_counts(const simdjson::padded_string& json_data, CorpusData& data) {
+    simdjson::ondemand::parser parser;
+    auto doc = parser.iterate(json_data);
+    
+    for (auto field : doc.get_object()) {
+        std::string_view key = field.unescaped_key();
+        int value = field.value().get_int64();
+        
+        if(key.length() == 3) {
+            data.trigram_counts.emplace_back(pack_trigram(to_lower(key[0]), to_lower(key[1]), to_lower(key[2])), value);
+            data.total_trigrams += value;
+        }
+    }
+
+    // merge grams that only differed in case
+    auto& grams = data.trigram_counts;
+    std::sort(grams.begin(), grams.end());
+    std::size_t out = 0;
+    for(std::size_t i = 0; i < grams.size(); i++) {
+        if(out > 0 && grams[out - 1].first == grams[i].first) grams[out - 1].second += grams[i].second;
+        else grams[out++] = grams[i];
+    }
+    grams.resize(out);
+}
+
+void parse_monogram_counts(const simdjson::padded_string& json_data, std::array<int, 256>& counts) {
     simdjson::ondemand::parser parser;
     auto doc = parser.iterate(json_data);
     
@@ -308,11 +369,33 @@ void parse_monogram_counts(const simdjson::padded_string& json_data, std::unorde
         std::string_view key = field.unescaped_key();
         
         int value = field.value().get_int64();
-        char key_char = key[0];
-        map[key_char] = value;
+        counts[to_lower(key[0])] += value;
     }
 }
 
+// Builds the filtered gram lists of data from the parsed counts.
+void filter_grams(CorpusData& data) {
+    data.monograms.clear();
+    for(int gram = 0; gram < 256; gram++) {
+        if(data.monogram_counts[gram] != 0) data.monograms.emplace_back(gram, data.monogram_counts[gram]);
+    }
+
+    data.bigrams.clear();
+    for(int first = 0; first < 256; first++) {
+        if(first == ' ') continue;
+        for(int second = 0; second < 256; second++) {
+            if(second == ' ' || second == first) continue;
+            int count = data.bigram(first, second);
+            if(count != 0) data.bigrams.emplace_back(first << 8 | second, count);
+        }
+    }
+
+    std::erase_if(data.trigram_counts, [](const auto& entry) {
+        auto [gram, count] = entry;
+        return count == 0 || ((gram >> 16) & 0xFF) == ' ' || ((gram >> 8) & 0xFF) == ' ' || (gram & 0xFF) == ' ';
+    });
+}
+
 void load_corpus(CorpusData& data, const std::string_view& corpus) {
     simdjson::padded_string monogram_json, bigram_json, trigram_json;
     data.corpus_name = std::string(corpus);
@@ -322,125 +405,103 @@ void load_corpus(CorpusData& data, const std::string_view& corpus) {
         parse_monogram_counts(monogram_json, data.monogram_counts);
     }
     if (load_json_file(get_path(corpus, "/bigrams"), bigram_json)) {
-        parse_ngram_counts(bigram_json, data.bigram_counts, 2);
+        parse_bigram_counts(bigram_json, data);
     }
     if (load_json_file(get_path(corpus, "/trigrams"), trigram_json)) {
-        parse_ngram_counts(trigram_json, data.trigram_counts, 3);
+        parse_trigram_counts(trigram_json, data);
     }
+    filter_grams(data);
 }
 
-std::pair<std::unordered_map<Finger, double>, double> get_usage(const KeyboardLayout& layout, const CorpusData& data) {
-    std::unordered_map<Finger, double> fingers;
-    for(const auto& [gram, count] : data.monogram_counts) {
-        char gram_char = std::tolower(gram);
-        if(!layout.char_to_key.contains(gram_char)) {
-            continue;
-        }
-        Finger finger = layout.char_to_key.find(gram_char)->second.finger;
-        fingers[finger] += count;
-    }
-    
-    double total = 0;
-    for(auto& [finger, count] : fingers) total += count;
+constexpr std::uint8_t NO_FINGER = 0xFF;
 
-    double right_hand = 0;
-    
-    for(auto& [finger, usage] : fingers) {
-        usage /= total;
-        switch(finger) {
-            case Finger::RT:
-            case Finger::RI:
-            case Finger::RM:
-            case Finger::RR:
-            case Finger::RP:
-            case Finger::TB:    
-                right_hand += usage;
-                break;
-            default:
-                break; 
-        }
+// Finger of every byte on a layout, NO_FINGER for bytes that are not on it.
+using FingerLookup = std::array<std::uint8_t, 256>;
+
+FingerLookup finger_lookup(const KeyboardLayout& layout) {
+    FingerLookup fingers;
+    fingers.fill(NO_FINGER);
+    for(const auto& [value, key] : layout.char_to_key) {
+        fingers[static_cast<unsigned char>(value)] = static_cast<std::uint8_t>(key.finger);
     }
-    return std::pair(fingers, right_hand * 100);
+    return fingers;
 }
 
-double get_sfb(const KeyboardLayout& layout, const CorpusData& data) {
-    double counts = 0;
-    double total_bigrams = 0;
-    
-    for (const auto& [_, count] : data.bigram_counts) {
-        total_bigrams += count;
-    }
-    
-    for(const auto& [gram, count] : data.bigram_counts) {
-        std::string gram_str(gram);
-        std::transform(gram_str.begin(), gram_str.end(), gram_str.begin(), ::tolower);
-        
-        if(std::any_of(gram_str.begin(), gram_str.end(),
-            [&](char c) { return layout.valid_keys.find(c) == layout.valid_keys.end(); })) continue;
-        
-        if(gram_str.find(' ') != std::string::npos || gram_str[0] == gram_str[1]) continue;
-        
-        if(layout.char_to_key.find(gram_str[0])->second.finger == layout.char_to_key.find(gram_str[1])->second.finger) {
-            counts += count;
-        }
+constexpr bool right_hand_finger(Finger finger) {
+    switch(finger) {
+        case Finger::RT:
+        case Finger::RI:
+        case Finger::RM:
+        case Finger::RR:
+        case Finger::RP:
+        case Finger::TB:
+            return true;
+        default:
+            return false;
     }
-    
-    return (counts / total_bigrams) * 100;
 }
 
+// All metrics in one pass per n-gram order over the filtered gram lists:
+// monograms give finger and hand usage, bigrams SFB, trigrams the combo
+// table types (rolls, alternates, redirects, SFS).
 LayoutStats get_stats(const KeyboardLayout& layout, const CorpusData& data) {
     LayoutStats stats;
     stats.corpus_name = data.corpus_name;
 
-    auto [finger_usage, right_hand_usage] = get_usage(layout, data);
-    stats.right_hand = right_hand_usage;
+    FingerLookup fingers = finger_lookup(layout);
+
+    std::array<double, FINGER_COUNT> finger_usage{};
+    for(const auto& [gram, count] : data.monograms) {
+        std::uint8_t finger = fingers[gram];
+        if(finger != NO_FINGER) finger_usage[finger] += count;
+    }
+
+    double total_usage = 0;
+    double right_usage = 0;
+    for(int finger = 0; finger < FINGER_COUNT; finger++) {
+        total_usage += finger_usage[finger];
+        if(right_hand_finger(static_cast<Finger>(finger))) right_usage += finger_usage[finger];
+    }
+    stats.right_hand = (right_usage / total_usage) * 100;
     stats.left_hand = 100 - stats.right_hand;
-    stats.sfb = get_sfb(layout, data);
 
-    double total_trigrams = 0;
-    double alternate_count = 0, roll_in_count = 0, roll_out_count = 0, oneh_in_count = 0,
-           oneh_out_count = 0, redirect_count = 0, bad_redirect_count = 0, dsfb_red_count = 0, dsfb_alt_count = 0;
+    double sfb = 0;
+    for(const auto& [gram, count] : data.bigrams) {
+        std::uint8_t finger1 = fingers[gram >> 8];
+        std::uint8_t finger2 = fingers[gram & 0xFF];
+        if(finger1 != NO_FINGER && finger1 == finger2) sfb += count;
+    }
+    stats.sfb = (sfb / data.total_bigrams) * 100;
 
+    // the thumb key classifies like the left thumb
+    FingerLookup combo_fingers = fingers;
+    for(std::uint8_t& finger : combo_fingers) {
+        if(finger == static_cast<std::uint8_t>(Finger::TB)) finger = static_cast<std::uint8_t>(Finger::LT);
+    }
+
+    std::array<double, static_cast<int>(Trigram::COUNT)> counts{};
     for(const auto& [gram, count] : data.trigram_counts) {
-        total_trigrams += count;
-        std::string gram_str(gram);
-        std::transform(gram_str.begin(), gram_str.end(), gram_str.begin(), ::tolower);
-
-        if(gram_str.find(' ') != std::string::npos) continue;
-        if(std::any_of(gram_str.begin(), gram_str.end(), [&](char c) { return layout.valid_keys.find(c) == layout.valid_keys.end(); })) continue;
-
-        Finger finger1 = layout.char_to_key.find(gram_str[0])->second.finger;
-        Finger finger2 = layout.char_to_key.find(gram_str[1])->second.finger;
-        Finger finger3 = layout.char_to_key.find(gram_str[2])->second.finger;
-
-        if(finger1 == Finger::TB) finger1 = Finger::LT;
-        if(finger2 == Finger::TB) finger2 = Finger::LT;
-        if(finger3 == Finger::TB) finger3 = Finger::LT;
-
-        auto combo_key = std::make_tuple(finger1, finger2, finger3);
-        std::string combo_type = combo_table.contains(combo_key) ? combo_table[combo_key] : "unknown";
-
-        if(combo_type == "alternate") alternate_count += count;
-        else if(combo_type == "roll-in") roll_in_count += count;
-        else if(combo_type == "roll-out") roll_out_count += count;
-        else if(combo_type == "oneh-in") oneh_in_count += count;
-        else if(combo_type == "oneh-out") oneh_out_count += count;
-        else if(combo_type == "redirect") redirect_count += count;
-        else if(combo_type == "bad-redirect") bad_redirect_count += count;
-        else if(combo_type == "dsfb-red") dsfb_red_count += count;
-        else if(combo_type == "dsfb-alt") dsfb_alt_count += count;
+        std::uint8_t finger1 = combo_fingers[(gram >> 16) & 0xFF];
+        std::uint8_t finger2 = combo_fingers[(gram >> 8) & 0xFF];
+        std::uint8_t finger3 = combo_fingers[gram & 0xFF];
+        if(finger1 == NO_FINGER || finger2 == NO_FINGER || finger3 == NO_FINGER) continue;
+
+        Trigram type = combo_table[combo_index(Finger(finger1), Finger(finger2), Finger(finger3))];
+        counts[static_cast<int>(type)] += count;
     }
 
+    double total_trigrams = data.total_trigrams;
     if(total_trigrams > 0) {
-        stats.alternate = (alternate_count / total_trigrams) * 100;
-        stats.roll_in = (roll_in_count / total_trigrams) * 100;
-        stats.roll_out = (roll_out_count / total_trigrams) * 100;
-        stats.oneh_in = (oneh_in_count / total_trigrams) * 100;
-        stats.oneh_out = (oneh_out_count / total_trigrams) * 100;
-        stats.redirect = (redirect_count / total_trigrams) * 100;
-        stats.bad_redirect = (bad_redirect_count / total_trigrams) * 100;
-        stats.dsfb_red = (dsfb_red_count / total_trigrams) * 100;
-        stats.dsfb_alt = (dsfb_alt_count / total_trigrams) * 100;
+        auto percent = [&](Trigram type) { return (counts[static_cast<int>(type)] / total_trigrams) * 100; };
+        stats.alternate = percent(Trigram::ALTERNATE);
+        stats.roll_in = percent(Trigram::ROLL_IN);
+        stats.roll_out = percent(Trigram::ROLL_OUT);
+        stats.oneh_in = percent(Trigram::ONEH_IN);
+        stats.oneh_out = percent(Trigram::ONEH_OUT);
+        stats.redirect = percent(Trigram::REDIRECT);
+        stats.bad_redirect = percent(Trigram::BAD_REDIRECT);
+        stats.dsfb_red = percent(Trigram::DSFB_RED);
+        stats.dsfb_alt = percent(Trigram::DSFB_ALT);
     }
 
     return stats;
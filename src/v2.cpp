@@ -1,74 +1,29 @@
-#include <algorithm>
-#include <array>
-#include <cctype>
-#include <chrono>
-#include <cmath>
-#include <cstdint>
-#include <execution>
-#include <expected>
-#include <fstream>
-#include <iomanip>
-#include <iostream>
-#include <set>
-#include <string>
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
-
-#include "mt_quotes.h"
-
-enum Error {
-    LAYOUT_PARSE_ERROR_INVALID_FILE,
-    CORPUS_ERROR_INVALID_FILE,
-};
-
-enum class Finger : std::uint8_t {
-    LP = 0,
-    LR = 1,
-    LM = 2,
-    LI = 3,
-    LT = 4,
-    RT = 5,
-    RI = 6,
-    RM = 7,
-    RR = 8,
-    RP = 9,
-    TB = 10,
-};
-
-enum class Hand : std::uint8_t {
-    LEFT = 0,
-    RIGHT = 1,
-};
-
-struct Key {
-    char value = '\0';
-    int row;
-    int column;
-    Finger finger;
-    Hand hand;
-};
-
-struct KeyboardLayout {
-    std::string name;
-    std::unordered_map<char, Key> char_to_key;
-    std::array<std::array<Key, 10>, 4> matrix;
-    std::unordered_set<char> valid_keys;
+#include "v2.hpp"
 
-    double score = 0;
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
 
-    void print() {
-        std::cout << name << ": \n\n"; 
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-        for (int row = 0; row < 4; row++) {
-            for (int col = 0; col < 10; col++) {
-                std::cout << matrix[row][col].value << " ";
-            }
-            std::cout << "\n";
-        }
-        std::cout << "Score:" << score << "\n";
+std::string_view error_message(Error error) {
+    switch (error) {
+    case LAYOUT_PARSE_ERROR_INVALID_FILE: return "could not read layout file";
+    case CORPUS_ERROR_INVALID_FILE: return "could not read corpus file";
+    case CORPUS_ERROR_INVALID_FORMAT: return "not a compiled corpus of this version";
+    case CORPUS_ERROR_CHECKSUM_MISMATCH: return "corpus checksum mismatch";
+    case OPTION_ERROR_INVALID_ARGUMENT: return "invalid argument";
+    case CONSTRAINT_ERROR_INVALID_FILE: return "could not read constraint file";
+    case CONSTRAINT_ERROR_UNSATISFIED: return "layout does not satisfy the constraints";
+    case WEIGHTS_ERROR_INVALID_FILE: return "could not read weights file";
+    case LAYOUT_ERROR_UNSCORED_CHARS: return "layout places characters the corpus does not count";
     }
-};
+    return "unknown error";
+}
 
 Finger get_finger(int col, Hand hand) {
     if (hand == Hand::LEFT) {
@@ -92,16 +47,19 @@ Finger get_finger(int col, Hand hand) {
     }
 }
 
-std::expected<KeyboardLayout, Error> load_layout(const std::string &file) {
+std::expected<KeyboardLayout, Error> load_layout_file(const std::filesystem::path &layout_file) {
     KeyboardLayout layout;
-    std::string layout_file = "../layouts/" + file;
 
     std::ifstream layout_file_stream(layout_file);
     if (!layout_file_stream) {
         return std::unexpected(LAYOUT_PARSE_ERROR_INVALID_FILE);
     }
 
-    std::getline(layout_file_stream, layout.name, ':');
+    // a "name:" header on the first line; anything else is not a layout
+    if (!std::getline(layout_file_stream, layout.name, ':') || layout_file_stream.eof() ||
+        layout.name.find('\n') != std::string::npos) {
+        return std::unexpected(LAYOUT_PARSE_ERROR_INVALID_FILE);
+    }
 
     for (int r = 0; r < 4; r++) {
         for (int c = 0; c < 10; c++) {
@@ -145,6 +103,7 @@ std::expected<KeyboardLayout, Error> load_layout(const std::string &file) {
 
         row++;
     }
+    if (layout.char_to_key.empty()) return std::unexpected(LAYOUT_PARSE_ERROR_INVALID_FILE);
 
     Key left_space = {' ', 3, 4, Finger::LT, Hand::LEFT};
     Key right_space = {' ', 3, 5, Finger::RT, Hand::RIGHT};
@@ -160,142 +119,2393 @@ std::expected<KeyboardLayout, Error> load_layout(const std::string &file) {
     return layout;
 }
 
-template <std::size_t T>
-void get_stats(KeyboardLayout &layout, const std::array<char, T> &corpus) {
-    constexpr double SFB_WEIGHT = 1;
-    constexpr double SFS_WEIGHT = 1;
+std::expected<KeyboardLayout, Error> load_layout(const std::string &file) {
+    return load_layout_file("../layouts/" + file);
+}
 
-    double sfb = 0;
-    double total_bigram_count = 1;
+Alphabet make_alphabet(std::string_view chars) {
+    Alphabet alphabet;
+    alphabet.ids.fill(NO_CHAR);
 
-    int sfs = 0;
-    int total_sfs_count = 1;
+    for (char ch : chars) {
+        if (ch == ' ' || static_cast<unsigned char>(ch) >= 0x80 || alphabet.id(ch) != NO_CHAR || alphabet.size == ALPHABET_SIZE)
+            continue;
 
-    for (std::size_t i = 0; i + 1 < T; ++i) {
-        char first = corpus[i];
-        char second = corpus[i + 1];
+        // upper case folds onto the same id, the corpus is never lowercased
+        unsigned char upper = std::toupper(static_cast<unsigned char>(ch));
+        if (alphabet.ids[upper] == NO_CHAR) alphabet.ids[upper] = alphabet.size;
 
-        if (layout.valid_keys.find(first) == layout.valid_keys.end() ||
-            layout.valid_keys.find(second) == layout.valid_keys.end() ||
-            first == ' ' || second == ' ')
-            continue;
+        alphabet.ids[static_cast<unsigned char>(ch)] = alphabet.size;
+        alphabet.chars[alphabet.size++] = ch;
+    }
 
-        total_bigram_count++;
+    return alphabet;
+}
 
-        if (first == second) continue;
-        
-        if (layout.char_to_key.at(first).finger == layout.char_to_key.at(second).finger)
-            sfb++;
+// Characters a layout places on its alpha keys, each once, in row order.
+std::string alpha_chars(const KeyboardLayout &layout) {
+    std::string chars;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 10; col++) {
+            char ch = layout.matrix[row][col].value;
+            if (ch != '\0' && ch != ' ' && chars.find(ch) == std::string::npos) chars += ch;
+        }
     }
+    return chars;
+}
 
-    double sfb_score = (sfb * 100) / total_bigram_count;
+// The alphabet to count text with for layouts placing the characters in
+// placed: DEFAULT_ALPHABET and every placed character. Default characters no
+// layout places give up their slots when the others would not fit.
+Alphabet layout_alphabet(std::string_view placed) {
+    std::string extra;
+    std::size_t placed_defaults = 0;
+    for (char ch : DEFAULT_ALPHABET) placed_defaults += placed.find(ch) != std::string_view::npos;
+    for (char ch : placed) {
+        if (ch != ' ' && DEFAULT_ALPHABET.find(ch) == std::string_view::npos && extra.find(ch) == std::string::npos)
+            extra += ch;
+    }
 
-    layout.score = sfb_score * SFB_WEIGHT;
+    std::size_t room = ALPHABET_SIZE - std::min(ALPHABET_SIZE, placed_defaults + extra.size());
+    std::string chars;
+    for (char ch : DEFAULT_ALPHABET) {
+        if (placed.find(ch) != std::string_view::npos) {
+            chars += ch;
+        } else if (room > 0) {
+            chars += ch;
+            room--;
+        }
+    }
+    return make_alphabet(chars + extra);
 }
 
-void swap_keys(KeyboardLayout &layout, char char1, char char2) {
-    // both characters are in the layout
-    if (layout.char_to_key.find(char1) == layout.char_to_key.end() ||
-        layout.char_to_key.find(char2) == layout.char_to_key.end()) {
-        return; 
+// Characters a layout places that alphabet has no counts for, and so would not
+// be scored.
+std::string unscored_chars(const KeyboardLayout &layout, const Alphabet &alphabet) {
+    std::string chars;
+    for (char ch : alpha_chars(layout)) {
+        if (alphabet.id(ch) == NO_CHAR) chars += ch;
     }
-    
-    Key key1 = layout.char_to_key.at(char1);
-    Key key2 = layout.char_to_key.at(char2);
-    
-    // swap char in matrix
-    layout.matrix[key1.row][key1.column].value = char2;
-    layout.matrix[key2.row][key2.column].value = char1;
-    
-    layout.char_to_key[char1] = Key { char1, key2.row, key2.column, 
-                                    get_finger(key2.column, key2.hand), key2.hand};
-    layout.char_to_key[char2] = Key{ char2, key1.row, key1.column, 
-                                    get_finger(key1.column, key1.hand), key1.hand};
-    
-    layout.matrix[key1.row][key1.column].finger = get_finger(key1.column, key1.hand);
-    layout.matrix[key1.row][key1.column].hand = key1.hand;
-    
-    layout.matrix[key2.row][key2.column].finger = get_finger(key2.column, key2.hand);
-    layout.matrix[key2.row][key2.column].hand = key2.hand;
+    return chars;
 }
 
-template <std::size_t T>
-KeyboardLayout gen_layout(KeyboardLayout layout, std::array<char, T> corpus) {
-    KeyboardLayout new_layout = layout;
-    std::string characters = "qwertyuiopasdfghjkl;zxcvbnm,./";
-    
-    for (int row = 0; row < 4; row++) {
-        for (int col = 0; col < 10; col++) {
-            char current_char = new_layout.matrix[row][col].value;
-            
-            if (current_char == '\0' || current_char == ' ') {
-                continue;
+// While counting, bytes outside the alphabet get the id SINK. The counting
+// tables have an extra row and column for it, so the counting loop never tests
+// whether a byte is in the alphabet; the SINK entries are dropped afterwards.
+constexpr std::uint8_t SINK = ALPHABET_SIZE;
+constexpr std::size_t COUNT_WIDTH = ALPHABET_SIZE + 1;
+
+struct CountTables {
+    std::array<std::uint64_t, COUNT_WIDTH> monograms{};
+    std::array<std::uint64_t, COUNT_WIDTH * COUNT_WIDTH> bigrams{};
+    std::array<std::uint64_t, COUNT_WIDTH * COUNT_WIDTH * COUNT_WIDTH> trigrams{};
+};
+
+std::uint8_t count_id(const Alphabet &alphabet, char ch) {
+    return std::min(alphabet.id(ch), SINK);
+}
+
+// Maps text to counting ids in one pass. Upper case folds onto lower case
+// through the alphabet and bytes outside it become SINK. The SIMD paths look up
+// the ASCII half of the id table with one byte shuffle per high nibble; the
+// alphabet never holds non-ASCII bytes, so those fall through to SINK.
+void normalize_ids(std::string_view text, std::uint8_t *ids, const Alphabet &alphabet) {
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i luts[8];
+    for (int high = 0; high < 8; high++) {
+        luts[high] = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(alphabet.ids.data() + high * 16)));
+    }
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i sink = _mm256_set1_epi8(SINK);
+
+    for (; i + 32 <= text.size(); i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text.data() + i));
+        __m256i low = _mm256_and_si256(bytes, nibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+
+        __m256i result = sink;
+        for (int h = 0; h < 8; h++) {
+            __m256i match = _mm256_cmpeq_epi8(high, _mm256_set1_epi8(h));
+            result = _mm256_blendv_epi8(result, _mm256_shuffle_epi8(luts[h], low), match);
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ids + i), _mm256_min_epu8(result, sink));
+    }
+#elif defined(__SSSE3__)
+    __m128i luts[8];
+    for (int high = 0; high < 8; high++) {
+        luts[high] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(alphabet.ids.data() + high * 16));
+    }
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i sink = _mm_set1_epi8(SINK);
+
+    for (; i + 16 <= text.size(); i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text.data() + i));
+        __m128i low = _mm_and_si128(bytes, nibble);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+
+        __m128i result = sink;
+        for (int h = 0; h < 8; h++) {
+            __m128i match = _mm_cmpeq_epi8(high, _mm_set1_epi8(h));
+            __m128i value = _mm_shuffle_epi8(luts[h], low);
+            result = _mm_or_si128(_mm_and_si128(match, value), _mm_andnot_si128(match, result));
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ids + i), _mm_min_epu8(result, sink));
+    }
+#endif
+
+    for (; i < text.size(); i++) ids[i] = count_id(alphabet, text[i]);
+}
+
+// Counts n-grams of text fed in arbitrary chunks. The last two ids are carried
+// over, so n-grams that straddle a chunk boundary are counted exactly once.
+struct NgramCounter {
+    CountTables &counts;
+    const Alphabet &alphabet;
+    std::uint8_t prev2 = SINK;
+    std::uint8_t prev1 = SINK;
+
+    void feed(std::string_view chunk) {
+        std::array<std::uint8_t, 4096> ids;
+
+        for (std::size_t offset = 0; offset < chunk.size(); offset += ids.size()) {
+            std::string_view piece = chunk.substr(offset, ids.size());
+            normalize_ids(piece, ids.data(), alphabet);
+
+            for (std::size_t i = 0; i < piece.size(); i++) {
+                std::uint8_t id = ids[i];
+                counts.monograms[id]++;
+                counts.bigrams[prev1 * COUNT_WIDTH + id]++;
+                counts.trigrams[(prev2 * COUNT_WIDTH + prev1) * COUNT_WIDTH + id]++;
+                prev2 = prev1;
+                prev1 = id;
             }
-            
-            KeyboardLayout best_for_position = new_layout;
-            double best_score = std::numeric_limits<double>::max();
-            char best_swap_char = current_char;
-            
-            // try swap every character
-            for (char test_char : characters) {
-                if (test_char == current_char) continue;
-                
-                if (new_layout.char_to_key.find(test_char) == new_layout.char_to_key.end()) {
-                    continue;
+        }
+    }
+};
+
+void merge_counts(CountTables &into, const CountTables &from) {
+    for (std::size_t i = 0; i < into.monograms.size(); i++) into.monograms[i] += from.monograms[i];
+    for (std::size_t i = 0; i < into.bigrams.size(); i++) into.bigrams[i] += from.bigrams[i];
+    for (std::size_t i = 0; i < into.trigrams.size(); i++) into.trigrams[i] += from.trigrams[i];
+}
+
+// Drops the SINK entries of counting tables.
+std::unique_ptr<NgramTables> fold_counts(const CountTables &counts, const Alphabet &alphabet) {
+    auto tables = std::make_unique<NgramTables>();
+    tables->alphabet = alphabet;
+
+    for (std::size_t a = 0; a < ALPHABET_SIZE; a++) {
+        tables->monograms[a] = counts.monograms[a];
+        for (std::size_t b = 0; b < ALPHABET_SIZE; b++) {
+            tables->bigrams[bigram_index(a, b)] = counts.bigrams[a * COUNT_WIDTH + b];
+            for (std::size_t c = 0; c < ALPHABET_SIZE; c++) {
+                tables->trigrams[trigram_index(a, b, c)] =
+                    counts.trigrams[(a * COUNT_WIDTH + b) * COUNT_WIDTH + c];
+            }
+        }
+    }
+
+    return tables;
+}
+
+std::unique_ptr<NgramTables> build_ngram_tables(std::string_view corpus, const Alphabet &alphabet) {
+    auto counts = std::make_unique<CountTables>();
+
+    NgramCounter counter{*counts, alphabet};
+    counter.feed(corpus);
+
+    return fold_counts(*counts, alphabet);
+}
+
+constexpr std::size_t CHUNK_SIZE = 1 << 20;
+
+// Counts the bytes of block after its first `history` bytes, which are the
+// tail of the previous block of the same file. The block is cut into one slice
+// per partial table; each thread counts the n-grams that end inside its slice
+// and seeds its history from the two bytes before it, so n-grams across a
+// seam are counted exactly once.
+void count_block(std::string_view block, std::size_t history,
+                 std::vector<std::unique_ptr<CountTables>> &partials, const Alphabet &alphabet) {
+    std::size_t size = block.size() - history;
+    std::size_t slices = std::clamp<std::size_t>(size / (CHUNK_SIZE / 16), 1, partials.size());
+
+    auto count_slice = [&](std::size_t slice) {
+        std::size_t begin = history + size * slice / slices;
+        std::size_t end = history + size * (slice + 1) / slices;
+
+        NgramCounter counter{*partials[slice], alphabet};
+        if (begin >= 2) counter.prev2 = count_id(alphabet, block[begin - 2]);
+        if (begin >= 1) counter.prev1 = count_id(alphabet, block[begin - 1]);
+        counter.feed(block.substr(begin, end - begin));
+    };
+
+    if (slices == 1) {
+        count_slice(0);
+        return;
+    }
+
+    std::vector<std::jthread> pool;
+    for (std::size_t slice = 0; slice < slices; slice++) pool.emplace_back(count_slice, slice);
+}
+
+// Streams a text file through count_block, one CHUNK_SIZE slice per thread at
+// a time.
+std::expected<void, Error> count_file(const std::filesystem::path &file,
+                                      std::vector<std::unique_ptr<CountTables>> &partials,
+                                      const Alphabet &alphabet, std::vector<char> &buffer) {
+    std::ifstream stream(file, std::ios::binary);
+    if (!stream) return std::unexpected(CORPUS_ERROR_INVALID_FILE);
+
+    std::size_t history = 0;
+    while (stream) {
+        stream.read(buffer.data() + history, buffer.size() - history);
+        std::size_t size = history + stream.gcount();
+        if (size == history) break;
+
+        count_block(std::string_view(buffer.data(), size), history, partials, alphabet);
+
+        history = std::min<std::size_t>(2, size);
+        std::copy(buffer.begin() + (size - history), buffer.begin() + size, buffer.begin());
+    }
+    if (stream.bad()) return std::unexpected(CORPUS_ERROR_INVALID_FILE);
+
+    return {};
+}
+
+// Counts a text file, or every regular file below a directory, on the given
+// number of threads (0 uses every hardware thread). Each thread fills its own
+// tables, which are summed at the end. Memory is bounded by one chunk and one
+// set of tables per thread, regardless of the input size.
+std::expected<std::unique_ptr<NgramTables>, Error> count_path(const std::filesystem::path &path,
+                                                              const Alphabet &alphabet,
+                                                              std::size_t threads = 0) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<std::unique_ptr<CountTables>> partials;
+    for (std::size_t i = 0; i < threads; i++) partials.push_back(std::make_unique<CountTables>());
+
+    std::vector<char> buffer(threads * CHUNK_SIZE + 2);
+    std::error_code error;
+
+    if (!std::filesystem::is_directory(path, error)) {
+        if (auto counted = count_file(path, partials, alphabet, buffer); !counted) {
+            return std::unexpected(counted.error());
+        }
+    } else {
+        // the non-throwing overloads throughout: an unreadable directory
+        // fails the count, an entry that cannot be inspected is skipped
+        std::filesystem::recursive_directory_iterator entry(path, error), end;
+        for (; !error && entry != end; entry.increment(error)) {
+            std::error_code entry_error;
+            if (!entry->is_regular_file(entry_error) || entry_error) continue;
+            if (auto counted = count_file(entry->path(), partials, alphabet, buffer); !counted) {
+                return std::unexpected(counted.error());
+            }
+        }
+        if (error) return std::unexpected(CORPUS_ERROR_INVALID_FILE);
+    }
+
+    for (std::size_t i = 1; i < partials.size(); i++) merge_counts(*partials[0], *partials[i]);
+    return fold_counts(*partials[0], alphabet);
+}
+
+// Compiled corpus file: a CorpusHeader followed by the NgramTables image in
+// native byte order. The analyzer maps it and reads the tables in place.
+constexpr std::array<char, 8> CORPUS_MAGIC = {'L', 'I', 'U', 'C', 'O', 'R', 'P', '\0'};
+constexpr std::uint32_t CORPUS_VERSION = 1;
+
+struct CorpusHeader {
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t alphabet_size; // ALPHABET_SIZE the tables were built with
+    std::uint64_t tables_offset;
+    std::uint64_t tables_size;
+    std::uint64_t checksum; // FNV-1a of the tables image
+    std::array<std::uint8_t, 24> reserved{};
+};
+
+static_assert(sizeof(CorpusHeader) == 64);
+static_assert(std::is_trivially_copyable_v<NgramTables>);
+
+std::uint64_t fnv1a(const void *data, std::size_t size) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (std::size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+std::string corpus_path(const std::string &name) {
+    return "../corpus/" + name + ".liu";
+}
+
+std::expected<void, Error> write_corpus(const std::string &file, const NgramTables &tables) {
+    std::ofstream out(file, std::ios::binary);
+    if (!out) return std::unexpected(CORPUS_ERROR_INVALID_FILE);
+
+    CorpusHeader header;
+    header.magic = CORPUS_MAGIC;
+    header.version = CORPUS_VERSION;
+    header.alphabet_size = ALPHABET_SIZE;
+    header.tables_offset = sizeof(CorpusHeader);
+    header.tables_size = sizeof(NgramTables);
+    header.checksum = fnv1a(&tables, sizeof(NgramTables));
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(&tables), sizeof(NgramTables));
+    if (!out) return std::unexpected(CORPUS_ERROR_INVALID_FILE);
+
+    return {};
+}
+
+std::expected<std::unique_ptr<MappedCorpus>, Error> map_corpus(const std::string &file) {
+    auto corpus = std::make_unique<MappedCorpus>();
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) return std::unexpected(CORPUS_ERROR_INVALID_FILE);
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(sizeof(CorpusHeader))) {
+        corpus->size = info.st_size;
+        corpus->data = mmap(nullptr, corpus->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (corpus->data == MAP_FAILED) return std::unexpected(CORPUS_ERROR_INVALID_FILE);
+
+    const auto *base = static_cast<const char *>(corpus->data);
+    const auto *header = reinterpret_cast<const CorpusHeader *>(base);
+
+    if (header->magic != CORPUS_MAGIC || header->version != CORPUS_VERSION ||
+        header->alphabet_size != ALPHABET_SIZE || header->tables_size != sizeof(NgramTables) ||
+        header->tables_offset % alignof(NgramTables) != 0 ||
+        header->tables_offset + header->tables_size > corpus->size) {
+        return std::unexpected(CORPUS_ERROR_INVALID_FORMAT);
+    }
+
+    corpus->tables = reinterpret_cast<const NgramTables *>(base + header->tables_offset);
+    if (fnv1a(corpus->tables, sizeof(NgramTables)) != header->checksum) {
+        return std::unexpected(CORPUS_ERROR_CHECKSUM_MISMATCH);
+    }
+
+    return corpus;
+}
+
+// Distance from the outside of the hand: pinky 0 through index 3.
+int finger_rank(Finger finger) {
+    switch (finger) {
+    case Finger::LP: case Finger::RP: return 0;
+    case Finger::LR: case Finger::RR: return 1;
+    case Finger::LM: case Finger::RM: return 2;
+    case Finger::LI: case Finger::RI: return 3;
+    default: return 4;
+    }
+}
+
+Trigram classify_trigram(const Key &key1, const Key &key2, const Key &key3) {
+    if (key1.finger == key2.finger || key2.finger == key3.finger) return Trigram::OTHER;
+
+    if (key1.hand == key3.hand && key1.hand != key2.hand)
+        return key1.finger == key3.finger ? Trigram::DSFB_ALT : Trigram::ALTERNATE;
+
+    int rank1 = finger_rank(key1.finger);
+    int rank2 = finger_rank(key2.finger);
+    int rank3 = finger_rank(key3.finger);
+
+    if (key1.hand == key2.hand && key2.hand != key3.hand)
+        return rank2 > rank1 ? Trigram::ROLL_IN : Trigram::ROLL_OUT;
+    if (key1.hand != key2.hand && key2.hand == key3.hand)
+        return rank3 > rank2 ? Trigram::ROLL_IN : Trigram::ROLL_OUT;
+
+    bool inward1 = rank2 > rank1;
+    bool inward2 = rank3 > rank2;
+    if (inward1 == inward2) return inward1 ? Trigram::ONEH_IN : Trigram::ONEH_OUT;
+    if (key1.finger == key3.finger) return Trigram::DSFB_RED;
+
+    bool index = rank1 == 3 || rank2 == 3 || rank3 == 3;
+    return index ? Trigram::REDIRECT : Trigram::BAD_REDIRECT;
+}
+
+Geometry build_geometry() {
+    Geometry geometry;
+
+    for (std::size_t pos = 0; pos < KEY_COUNT; pos++) {
+        int row = pos / 10;
+        int col = pos % 10;
+        Hand hand = col < 5 ? Hand::LEFT : Hand::RIGHT;
+        int hand_col = hand == Hand::LEFT ? col : col - 5;
+        geometry.keys[pos] = {'\0', row, col, get_finger(hand_col, hand), hand};
+        geometry.mirror[pos] = row * 10 + 9 - col;
+    }
+
+    for (std::size_t p = 0; p < KEY_COUNT; p++) {
+        for (std::size_t q = 0; q < KEY_COUNT; q++) {
+            geometry.same_finger[pair_index(p, q)] =
+                p != q && geometry.keys[p].finger == geometry.keys[q].finger;
+
+            for (std::size_t r = 0; r < KEY_COUNT; r++) {
+                geometry.trigrams[triple_index(p, q, r)] =
+                    classify_trigram(geometry.keys[p], geometry.keys[q], geometry.keys[r]);
+            }
+        }
+    }
+
+    return geometry;
+}
+
+const Geometry geometry = build_geometry();
+
+// Zobrist keys: a layout hashes to the XOR of ZOBRIST[id][pos] over its
+// placed characters, so a swap updates the hash with four XORs.
+constexpr auto ZOBRIST = [] {
+    std::array<std::array<std::uint64_t, KEY_COUNT>, ALPHABET_SIZE> keys{};
+    std::uint64_t state = 0x6c69757a6f627269; // splitmix64
+    for (auto &row : keys) {
+        for (std::uint64_t &key : row) {
+            std::uint64_t z = (state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            key = z ^ (z >> 31);
+        }
+    }
+    return keys;
+}();
+
+// Zobrist hash of a layout from scratch.
+std::uint64_t layout_hash(const CompactLayout &layout) {
+    std::uint64_t hash = 0;
+    for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+        if (layout.keys[pos] != NO_CHAR) hash ^= ZOBRIST[layout.keys[pos]][pos];
+    }
+    return hash;
+}
+
+// Hash the layout, hashing to hash, would have after swapping the placed
+// characters id1 and id2.
+std::uint64_t swapped_hash(std::uint64_t hash, const CompactLayout &layout, std::uint8_t id1, std::uint8_t id2) {
+    std::uint8_t pos1 = layout.positions[id1];
+    std::uint8_t pos2 = layout.positions[id2];
+    return hash ^ ZOBRIST[id1][pos1] ^ ZOBRIST[id1][pos2] ^ ZOBRIST[id2][pos2] ^ ZOBRIST[id2][pos1];
+}
+
+CompactLayout to_compact(const KeyboardLayout &layout, const Alphabet &alphabet) {
+    CompactLayout compact;
+    compact.keys.fill(NO_CHAR);
+    compact.positions.fill(NO_POSITION);
+
+    for (std::uint8_t id = 0; id < alphabet.size; id++) {
+        auto key = layout.char_to_key.find(alphabet.chars[id]);
+        if (key == layout.char_to_key.end() || key->second.row >= 3) continue;
+
+        std::uint8_t pos = key->second.row * 10 + key->second.column;
+        compact.positions[id] = pos;
+        compact.keys[pos] = id;
+    }
+
+    return compact;
+}
+
+// Moves every placed alphabet character of a layout to its key in compact.
+// Characters outside the alphabet keep their keys.
+void apply_layout(KeyboardLayout &layout, const CompactLayout &compact, const Alphabet &alphabet) {
+    for (std::size_t id = 0; id < alphabet.size; id++) {
+        std::uint8_t pos = compact.positions[id];
+        if (pos == NO_POSITION) continue;
+
+        Key key = geometry.keys[pos];
+        key.value = alphabet.chars[id];
+        layout.matrix[key.row][key.column] = key;
+        layout.char_to_key[key.value] = key;
+    }
+}
+
+const Constraints UNCONSTRAINED;
+
+bool can_swap(const Constraints &constraints, const Positions &positions, std::uint8_t id1, std::uint8_t id2) {
+    return constraints.allows(id1, positions[id2]) && constraints.allows(id2, positions[id1]);
+}
+
+bool satisfies(const Constraints &constraints, const CompactLayout &layout) {
+    for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+        if (layout.keys[pos] != NO_CHAR && !constraints.allows(layout.keys[pos], pos)) return false;
+    }
+    return true;
+}
+
+ScoreKernel make_kernel(const Weights &weights) {
+    ScoreKernel kernel;
+    kernel.weights = weights;
+
+    std::array<double, static_cast<std::size_t>(Trigram::COUNT)> trigram_weights{};
+    trigram_weights[static_cast<std::size_t>(Trigram::ALTERNATE)] = weights.alternate;
+    trigram_weights[static_cast<std::size_t>(Trigram::ROLL_IN)] = weights.roll_in;
+    trigram_weights[static_cast<std::size_t>(Trigram::ROLL_OUT)] = weights.roll_out;
+    trigram_weights[static_cast<std::size_t>(Trigram::ONEH_IN)] = weights.oneh_in;
+    trigram_weights[static_cast<std::size_t>(Trigram::ONEH_OUT)] = weights.oneh_out;
+    trigram_weights[static_cast<std::size_t>(Trigram::REDIRECT)] = weights.redirect;
+    trigram_weights[static_cast<std::size_t>(Trigram::BAD_REDIRECT)] = weights.bad_redirect;
+    trigram_weights[static_cast<std::size_t>(Trigram::DSFB_RED)] = weights.dsfb_red;
+    trigram_weights[static_cast<std::size_t>(Trigram::DSFB_ALT)] = weights.dsfb_alt;
+
+    for (std::size_t p = 0; p < KEY_COUNT; p++) {
+        kernel.key_cost[p] = geometry.keys[p].hand == Hand::LEFT ? weights.left_hand : weights.right_hand;
+        for (std::size_t q = 0; q < KEY_COUNT; q++) {
+            kernel.pair_cost[pair_index(p, q)] = weights.sfb * geometry.same_finger[pair_index(p, q)];
+            for (std::size_t r = 0; r < KEY_COUNT; r++) {
+                std::size_t index = triple_index(p, q, r);
+                kernel.triple_cost[index] = trigram_weights[static_cast<std::size_t>(geometry.trigrams[index])];
+            }
+        }
+    }
+
+    kernel.uses_keys = weights.left_hand != 0 || weights.right_hand != 0;
+    kernel.uses_trigrams = std::any_of(trigram_weights.begin(), trigram_weights.end(),
+                                       [](double weight) { return weight != 0; });
+    return kernel;
+}
+
+// The kernel every score uses. Replaced once at startup, before any optimizer
+// thread runs, when --weights is given.
+ScoreKernel scoring = make_kernel(Weights{});
+
+// The representative of the class of layouts equivalent to layout under
+// dedupe: of the layout and its mirror, the one with the smaller keys array,
+// after FINGERS has sorted the characters on every finger by id. Equivalent
+// layouts have equal canonical forms and, on symmetric metrics like SFB, equal
+// scores. Unequal hand weights tell a layout from its mirror, so the mirror is
+// left out then.
+//
+// Without trigram weights the score only sees which characters share a
+// finger and which hand each is on, so FINGERS also sorts the groups of
+// fingers with the same number of keys: across both hands when the hand
+// weights are equal, within each hand otherwise.
+CompactLayout canonical_layout(const CompactLayout &layout, Dedupe dedupe) {
+    if (dedupe == Dedupe::NONE) return layout;
+    const bool symmetric = scoring.weights.left_hand == scoring.weights.right_hand;
+
+    constexpr std::size_t FINGERS = static_cast<std::size_t>(Finger::RP) + 1;
+    auto finger_of = [](std::uint8_t pos) { return static_cast<std::size_t>(geometry.keys[pos].finger); };
+    auto left_finger = [](std::size_t finger) { return finger <= static_cast<std::size_t>(Finger::LT); };
+
+    auto normalize = [&](CompactLayout &candidate) {
+        if (dedupe != Dedupe::FINGERS) return;
+
+        std::array<std::array<std::uint8_t, KEY_COUNT>, FINGERS> groups;
+        std::array<std::size_t, FINGERS> sizes{};
+        for (auto &group : groups) group.fill(NO_CHAR);
+        for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+            std::size_t finger = finger_of(pos);
+            groups[finger][sizes[finger]++] = candidate.keys[pos];
+        }
+        for (std::size_t finger = 0; finger < FINGERS; finger++) {
+            std::sort(groups[finger].begin(), groups[finger].begin() + sizes[finger]);
+        }
+
+        if (!scoring.uses_trigrams) {
+            std::array<bool, FINGERS> sorted{};
+            for (std::size_t finger = 0; finger < FINGERS; finger++) {
+                if (sorted[finger] || sizes[finger] == 0) continue;
+
+                std::array<std::size_t, FINGERS> peers;
+                std::size_t count = 0;
+                for (std::size_t other = finger; other < FINGERS; other++) {
+                    if (sizes[other] != sizes[finger]) continue;
+                    if (!symmetric && left_finger(other) != left_finger(finger)) continue;
+                    peers[count++] = other;
+                    sorted[other] = true;
                 }
-                
-                KeyboardLayout temp_layout = new_layout;
-                swap_keys(temp_layout, current_char, test_char);
-                
-                get_stats(temp_layout, corpus);
-                
-                if (temp_layout.score < best_score) {
-                    best_score = temp_layout.score;
-                    best_for_position = temp_layout;
-                    best_swap_char = test_char;
+
+                std::array<std::array<std::uint8_t, KEY_COUNT>, FINGERS> swapped;
+                for (std::size_t i = 0; i < count; i++) swapped[i] = groups[peers[i]];
+                std::sort(swapped.begin(), swapped.begin() + count);
+                for (std::size_t i = 0; i < count; i++) groups[peers[i]] = swapped[i];
+            }
+        }
+
+        sizes.fill(0);
+        for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+            std::size_t finger = finger_of(pos);
+            candidate.keys[pos] = groups[finger][sizes[finger]++];
+            if (candidate.keys[pos] != NO_CHAR) candidate.positions[candidate.keys[pos]] = pos;
+        }
+    };
+
+    CompactLayout same = layout;
+    CompactLayout mirrored = layout;
+    for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+        std::uint8_t id = layout.keys[pos];
+        mirrored.keys[geometry.mirror[pos]] = id;
+        if (id != NO_CHAR) mirrored.positions[id] = geometry.mirror[pos];
+    }
+
+    normalize(same);
+    normalize(mirrored);
+
+    CompactLayout &canonical = symmetric && mirrored.keys < same.keys ? mirrored : same;
+    return canonical;
+}
+
+// Bigrams whose characters are both placed on the layout; the denominator of
+// every bigram percentage.
+double placed_bigram_total(const Positions &positions, const NgramTables &tables) {
+    const std::size_t size = tables.alphabet.size;
+    double total = 0;
+
+    for (std::size_t first = 0; first < size; ++first) {
+        if (positions[first] == NO_POSITION) continue;
+
+        for (std::size_t second = 0; second < size; ++second) {
+            if (positions[second] != NO_POSITION) total += tables.bigrams[bigram_index(first, second)];
+        }
+    }
+
+    return total;
+}
+
+PlacedTotals placed_totals(const Positions &positions, const NgramTables &tables) {
+    const std::size_t size = tables.alphabet.size;
+    PlacedTotals totals;
+    totals.bigrams = placed_bigram_total(positions, tables);
+
+    for (std::size_t first = 0; first < size; ++first) {
+        if (positions[first] == NO_POSITION) continue;
+        totals.monograms += tables.monograms[first];
+        if (!scoring.uses_trigrams) continue;
+
+        for (std::size_t second = 0; second < size; ++second) {
+            if (positions[second] == NO_POSITION) continue;
+            for (std::size_t third = 0; third < size; ++third) {
+                if (positions[third] != NO_POSITION) {
+                    totals.trigrams += tables.trigrams[trigram_index(first, second, third)];
                 }
             }
-            
-            new_layout = best_for_position;
         }
     }
-    
-    return new_layout;
+
+    return totals;
 }
 
-int main() {
-    std::array<char, mt_quotes.size()> corpus;
-    std::transform(
-        mt_quotes.begin(), mt_quotes.end(), corpus.begin(),
-        [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
-    
-    auto base_layout = load_layout("semimak");
-    get_stats(*base_layout, corpus);
-    base_layout->print();
-    
-    KeyboardLayout optimized_layout = static_cast<KeyboardLayout>(*base_layout); 
-    
-    auto start = std::chrono::high_resolution_clock::now();
-    optimized_layout = gen_layout(optimized_layout, corpus); 
-    get_stats(optimized_layout, corpus);
+// The weighted score of a layout straight from the scoring kernel, without
+// building LayoutStats.
+double score_layout(const Positions &positions, const NgramTables &tables) {
+    const std::size_t size = tables.alphabet.size;
+    double score = 0;
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    double bigram_cost = 0, bigram_total = 0;
+    for (std::size_t first = 0; first < size; ++first) {
+        std::uint8_t p = positions[first];
+        if (p == NO_POSITION) continue;
 
-    optimized_layout.print(); 
+        for (std::size_t second = 0; second < size; ++second) {
+            std::uint8_t q = positions[second];
+            if (q == NO_POSITION) continue;
 
+            double count = tables.bigrams[bigram_index(first, second)];
+            bigram_total += count;
+            bigram_cost += count * scoring.pair_cost[pair_index(p, q)];
+        }
+    }
+    if (bigram_total > 0) score += (bigram_cost * 100) / bigram_total;
 
-    std::cout << duration.count() << " ns\n"; 
-    
-    return 0;
+    if (scoring.uses_keys) {
+        double key_cost = 0, monogram_total = 0;
+        for (std::size_t id = 0; id < size; id++) {
+            std::uint8_t p = positions[id];
+            if (p == NO_POSITION) continue;
+
+            monogram_total += tables.monograms[id];
+            key_cost += tables.monograms[id] * scoring.key_cost[p];
+        }
+        if (monogram_total > 0) score += (key_cost * 100) / monogram_total;
+    }
+
+    if (scoring.uses_trigrams) {
+        double trigram_cost = 0, trigram_total = 0;
+        for (std::size_t first = 0; first < size; ++first) {
+            std::uint8_t p = positions[first];
+            if (p == NO_POSITION) continue;
+
+            for (std::size_t second = 0; second < size; ++second) {
+                std::uint8_t q = positions[second];
+                if (q == NO_POSITION) continue;
+
+                for (std::size_t third = 0; third < size; ++third) {
+                    std::uint8_t r = positions[third];
+                    if (r == NO_POSITION) continue;
+
+                    double count = tables.trigrams[trigram_index(first, second, third)];
+                    trigram_total += count;
+                    trigram_cost += count * scoring.triple_cost[triple_index(p, q, r)];
+                }
+            }
+        }
+        if (trigram_total > 0) score += (trigram_cost * 100) / trigram_total;
+    }
+
+    return score;
+}
+
+template struct Evaluator<SFB>;
+template struct Evaluator<SFB, SFS, Alternates, Rolls, OneHands, Redirects, HandBalance>;
+
+double get_sfb(const Positions &positions, const NgramTables &tables) {
+    return SfbEvaluator::evaluate(positions, tables).sfb;
 }
 
+LayoutStats get_stats(const Positions &positions, const NgramTables &tables) {
+    return StatsEvaluator::evaluate(positions, tables);
+}
+
+double layout_score(const LayoutStats &stats) {
+    const Weights &weights = scoring.weights;
+    return stats.alternate * weights.alternate + stats.roll_in * weights.roll_in +
+           stats.roll_out * weights.roll_out + stats.oneh_in * weights.oneh_in +
+           stats.oneh_out * weights.oneh_out + stats.redirect * weights.redirect +
+           stats.bad_redirect * weights.bad_redirect + stats.sfb * weights.sfb +
+           stats.dsfb_red * weights.dsfb_red + stats.dsfb_alt * weights.dsfb_alt +
+           stats.left_hand * weights.left_hand + stats.right_hand * weights.right_hand;
+}
 
-// Explore the following later:
-// 1. Simulated annealing: Allows occasional "bad" moves to escape local optima
-// 2. Genetic algorithms: Evolves multiple candidate solutions simultaneously
-// 3. Hill climbing with restarts: Tries multiple random starting points
-// 4. Branch and bound: Systematically explores the solution space
+LayoutStats get_stats(KeyboardLayout &layout, const NgramTables &tables) {
+    LayoutStats stats = get_stats(to_compact(layout, tables.alphabet).positions, tables);
+    layout.score = layout_score(stats);
+    return stats;
+}
+
+void swap_keys(KeyboardLayout &layout, char char1, char char2) {
+    // both characters are in the layout
+    if (layout.char_to_key.find(char1) == layout.char_to_key.end() ||
+        layout.char_to_key.find(char2) == layout.char_to_key.end()) {
+        return; 
+    }
+    
+    Key key1 = layout.char_to_key.at(char1);
+    Key key2 = layout.char_to_key.at(char2);
+    
+    // swap char in matrix, finger and hand stay with the position
+    layout.matrix[key1.row][key1.column].value = char2;
+    layout.matrix[key2.row][key2.column].value = char1;
+    
+    layout.char_to_key[char1] = Key{char1, key2.row, key2.column, key2.finger, key2.hand};
+    layout.char_to_key[char2] = Key{char2, key1.row, key1.column, key1.finger, key1.hand};
+}
+
+void swap_keys(CompactLayout &layout, std::uint8_t id1, std::uint8_t id2) {
+    std::uint8_t pos1 = layout.positions[id1];
+    std::uint8_t pos2 = layout.positions[id2];
+    if (pos1 == NO_POSITION || pos2 == NO_POSITION) return;
+
+    layout.keys[pos1] = id2;
+    layout.keys[pos2] = id1;
+    layout.positions[id1] = pos2;
+    layout.positions[id2] = pos1;
+}
+
+// Swaps the characters and brings hash, the layout's Zobrist hash, along.
+void swap_keys(CompactLayout &layout, std::uint64_t &hash, std::uint8_t id1, std::uint8_t id2) {
+    if (layout.positions[id1] == NO_POSITION || layout.positions[id2] == NO_POSITION) return;
+
+    hash = swapped_hash(hash, layout, id1, id2);
+    swap_keys(layout, id1, id2);
+}
+
+// Change of the score if the characters with ids id1 and id2 traded
+// positions. Only bigrams that contain one of the two characters can change
+// cost, and bigrams made of id1 and id2 keep theirs since pair costs are
+// symmetric, so the sum runs over the other placed characters only. Key costs
+// change for the two characters alone; trigrams are summed over the ones that
+// contain id1 or id2, which is what makes trigram weights expensive.
+double swap_delta(const Positions &positions, const NgramTables &tables, const PlacedTotals &totals,
+                  std::uint8_t id1, std::uint8_t id2) {
+    if (id1 == NO_CHAR || id2 == NO_CHAR) return 0;
+
+    std::uint8_t p1 = positions[id1];
+    std::uint8_t p2 = positions[id2];
+    if (p1 == NO_POSITION || p2 == NO_POSITION || totals.bigrams <= 0) return 0;
+
+    double bigrams = 0;
+
+    for (std::size_t other = 0; other < tables.alphabet.size; other++) {
+        std::uint8_t q = positions[other];
+        if (q == NO_POSITION || other == id1 || other == id2) continue;
+
+        double count1 = tables.bigrams[bigram_index(id1, other)] + tables.bigrams[bigram_index(other, id1)];
+        double count2 = tables.bigrams[bigram_index(id2, other)] + tables.bigrams[bigram_index(other, id2)];
+
+        bigrams += (count1 - count2) *
+                   (scoring.pair_cost[pair_index(p2, q)] - scoring.pair_cost[pair_index(p1, q)]);
+    }
+
+    double delta = (bigrams * 100) / totals.bigrams;
+
+    if (scoring.uses_keys && totals.monograms > 0) {
+        double keys = (static_cast<double>(tables.monograms[id1]) - static_cast<double>(tables.monograms[id2])) *
+                      (scoring.key_cost[p2] - scoring.key_cost[p1]);
+        delta += (keys * 100) / totals.monograms;
+    }
+
+    if (scoring.uses_trigrams && totals.trigrams > 0) {
+        Positions after = positions;
+        after[id1] = p2;
+        after[id2] = p1;
+
+        auto moved = [&](std::size_t id) { return id == id1 || id == id2; };
+        auto change = [&](std::size_t a, std::size_t b, std::size_t c) {
+            double count = tables.trigrams[trigram_index(a, b, c)];
+            return count * (scoring.triple_cost[triple_index(after[a], after[b], after[c])] -
+                            scoring.triple_cost[triple_index(positions[a], positions[b], positions[c])]);
+        };
+
+        // every placed trigram with a moved character, once: by the first
+        // slot that holds one
+        double trigrams = 0;
+        for (std::uint8_t x : {id1, id2}) {
+            for (std::size_t b = 0; b < tables.alphabet.size; b++) {
+                if (positions[b] == NO_POSITION) continue;
+                for (std::size_t c = 0; c < tables.alphabet.size; c++) {
+                    if (positions[c] == NO_POSITION) continue;
+                    trigrams += change(x, b, c);
+                    if (!moved(b)) trigrams += change(b, x, c);
+                    if (!moved(b) && !moved(c)) trigrams += change(b, c, x);
+                }
+            }
+        }
+        delta += (trigrams * 100) / totals.trigrams;
+    }
+
+    return delta;
+}
+
+#ifdef LIU_CHECKED
+// Rescores the swapped layout from scratch and aborts if the incremental
+// delta disagrees with it.
+void check_swap_delta(const CompactLayout &layout, const NgramTables &tables,
+                      std::uint8_t id1, std::uint8_t id2, double delta) {
+    CompactLayout after = layout;
+    swap_keys(after, id1, id2);
+
+    double expected = score_layout(after.positions, tables) - score_layout(layout.positions, tables);
+    if (std::abs(expected - delta) > 1e-9) {
+        std::cerr << "swap_delta mismatch for '" << tables.alphabet.chars[id1] << "' <-> '"
+                  << tables.alphabet.chars[id2] << "': " << delta << " (expected " << expected << ")\n";
+        std::abort();
+    }
+}
+#endif
+
+KeyboardLayout gen_layout(KeyboardLayout layout, const NgramTables &tables,
+                          const Constraints &constraints) {
+    const Alphabet &alphabet = tables.alphabet;
+    std::string characters = "qwertyuiopasdfghjkl;zxcvbnm,./";
+
+    CompactLayout new_layout = to_compact(layout, alphabet);
+    PlacedTotals totals = placed_totals(new_layout.positions, tables);
+    
+    for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+        std::uint8_t current_id = new_layout.keys[pos];
+        if (current_id == NO_CHAR) continue;
+
+        double best_delta = std::numeric_limits<double>::max();
+        std::uint8_t best_swap_id = current_id;
+        
+        // try swap every character
+        for (char test_char : characters) {
+            std::uint8_t test_id = alphabet.id(test_char);
+            if (test_id == NO_CHAR || test_id == current_id) continue;
+            if (new_layout.positions[test_id] == NO_POSITION) continue;
+            if (!can_swap(constraints, new_layout.positions, current_id, test_id)) continue;
+            
+            double delta = swap_delta(new_layout.positions, tables, totals, current_id, test_id);
+#ifdef LIU_CHECKED
+            check_swap_delta(new_layout, tables, current_id, test_id, delta);
+#endif
+            
+            if (delta < best_delta) {
+                best_delta = delta;
+                best_swap_id = test_id;
+            }
+        }
+        
+        swap_keys(new_layout, current_id, best_swap_id);
+    }
+    
+    apply_layout(layout, new_layout, alphabet);
+    get_stats(layout, tables);
+    return layout;
+}
+
+void print_cache_stats(const ScoreCache &cache) {
+    std::uint64_t lookups = cache.lookups.load();
+    std::uint64_t hits = cache.hits.load();
+    std::cerr << "cache: " << cache.capacity() << " slots, " << lookups << " lookups, " << hits << " hits ("
+              << std::fixed << std::setprecision(1) << (lookups ? 100.0 * hits / lookups : 0.0) << "%)"
+              << std::defaultfloat << "\n";
+}
+
+// Temperature after the given fraction of the budget has been spent.
+double anneal_temperature(const AnnealConfig &config, double progress) {
+    if (config.schedule == Schedule::NONE) return 0;
+    if (config.schedule == Schedule::LINEAR) {
+        return config.start_temperature +
+               (config.end_temperature - config.start_temperature) * progress;
+    }
+    return config.start_temperature *
+           std::pow(config.end_temperature / config.start_temperature, progress);
+}
+
+// Placed alphabet characters, the ones an optimizer may move.
+std::vector<std::uint8_t> movable_ids(const Positions &positions, const Alphabet &alphabet) {
+    std::vector<std::uint8_t> movable;
+    for (std::uint8_t id = 0; id < alphabet.size; id++) {
+        if (positions[id] != NO_POSITION) movable.push_back(id);
+    }
+    return movable;
+}
+
+// A random rearrangement of the movable characters: a uniform shuffle, or
+// under constraints a long random walk of legal swaps.
+void shuffle_layout(CompactLayout &layout, const std::vector<std::uint8_t> &movable,
+                    const Constraints &constraints, std::mt19937_64 &rng) {
+    if (movable.size() < 2) return;
+
+    if (constraints.unconstrained()) {
+        for (std::size_t i = movable.size(); i > 1; i--) {
+            std::uniform_int_distribution<std::size_t> pick(0, i - 1);
+            swap_keys(layout, movable[i - 1], movable[pick(rng)]);
+        }
+        return;
+    }
+
+    std::uniform_int_distribution<std::size_t> pick(0, movable.size() - 1);
+    for (std::size_t i = 0; i < 16 * movable.size() * movable.size(); i++) {
+        std::uint8_t id1 = movable[pick(rng)];
+        std::uint8_t id2 = movable[pick(rng)];
+        if (id1 != id2 && can_swap(constraints, layout.positions, id1, id2)) swap_keys(layout, id1, id2);
+    }
+}
+
+// Simulated annealing over random swaps of the placed alphabet characters,
+// scored incrementally with swap_delta. Returns the best layout seen.
+// With a cache, the score of every proposed layout is looked up by its hash
+// first and stored after a miss, so layouts other chains or earlier steps
+// already scored skip swap_delta.
+ChainResult anneal_chain(CompactLayout layout, const NgramTables &tables, const AnnealConfig &config,
+                         const Constraints &constraints, std::mt19937_64 &rng, ScoreCache *cache = nullptr) {
+    PlacedTotals totals = placed_totals(layout.positions, tables);
+    double score = score_layout(layout.positions, tables);
+    std::uint64_t hash = layout_hash(layout);
+    ChainResult best = {layout, score};
+
+    std::vector<std::uint8_t> movable = movable_ids(layout.positions, tables.alphabet);
+    if (movable.size() < 2) return best;
+
+    std::uniform_int_distribution<std::size_t> pick(0, movable.size() - 1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    auto start = std::chrono::steady_clock::now();
+    double temperature = config.start_temperature;
+    CacheStats cache_stats;
+
+    for (std::uint64_t i = 0;; i++) {
+        if (config.time_limit <= 0 && i >= config.iterations) break;
+
+        // the schedule only needs to move every so often
+        if ((i & 1023) == 0) {
+            double progress;
+            if (config.time_limit > 0) {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                progress = elapsed.count() / config.time_limit;
+            } else {
+                progress = static_cast<double>(i) / config.iterations;
+            }
+
+            if (progress >= 1) break;
+            temperature = anneal_temperature(config, progress);
+        }
+
+        std::uint8_t id1 = movable[pick(rng)];
+        std::uint8_t id2 = movable[pick(rng)];
+        if (id1 == id2 || !can_swap(constraints, layout.positions, id1, id2)) continue;
+
+        double delta;
+        std::uint64_t next_hash = swapped_hash(hash, layout, id1, id2);
+        std::optional<double> cached = cache ? cache->find(next_hash, cache_stats) : std::nullopt;
+        if (cached) {
+            delta = *cached - score;
+        } else {
+            delta = swap_delta(layout.positions, tables, totals, id1, id2);
+            if (cache) cache->store(next_hash, score + delta);
+        }
+
+        if (delta <= 0 || (temperature > 0 && unit(rng) < std::exp(-delta / temperature))) {
+            swap_keys(layout, hash, id1, id2);
+            score += delta;
+
+            if (score < best.score) {
+                best = {layout, score};
+            }
+        }
+    }
+    if (cache) cache->merge(cache_stats);
+
+#ifdef LIU_CHECKED
+    double expected = score_layout(layout.positions, tables);
+    if (std::abs(expected - score) > 1e-6) {
+        std::cerr << "anneal_chain drifted: " << score << " (expected " << expected << ")\n";
+        std::abort();
+    }
+#endif
+
+    return best;
+}
+
+KeyboardLayout anneal_layout(KeyboardLayout layout, const NgramTables &tables, const AnnealConfig &config,
+                             const Constraints &constraints, ScoreCache *cache) {
+    std::mt19937_64 rng(config.seed);
+    ChainResult best = anneal_chain(to_compact(layout, tables.alphabet), tables, config, constraints, rng, cache);
+
+    apply_layout(layout, best.layout, tables.alphabet);
+    get_stats(layout, tables);
+    return layout;
+}
+
+// Requires a placed bigram; the caller checks placed_bigram_total first.
+SwapTable make_swap_table(const CompactLayout &layout, const std::vector<std::uint8_t> &movable,
+                          const NgramTables &tables) {
+    SwapTable table;
+    table.n = movable.size();
+    table.tables = &tables;
+    table.positions = layout.positions;
+    table.totals = placed_totals(layout.positions, tables);
+    table.scale = 100 / table.totals.bigrams;
+
+    const double key_scale = table.totals.monograms > 0 ? table.totals.bigrams / table.totals.monograms : 0;
+
+    for (std::size_t i = 0; i < table.n; i++) {
+        table.place[i] = layout.positions[movable[i]];
+        table.ids[i] = movable[i];
+        table.key_flow[i] = scoring.uses_keys ? tables.monograms[movable[i]] * key_scale : 0;
+        for (std::size_t j = 0; j < table.n; j++) {
+            if (i == j) continue;
+            table.flow[i][j] = tables.bigrams[bigram_index(movable[i], movable[j])] +
+                               tables.bigrams[bigram_index(movable[j], movable[i])];
+        }
+    }
+
+    for (std::size_t p = 0; p < KEY_COUNT; p++) {
+        for (std::size_t q = 0; q < KEY_COUNT; q++) {
+            table.cost[p][q] = scoring.pair_cost[pair_index(p, q)];
+        }
+    }
+
+    for (auto &row : table.delta) row.fill(std::numeric_limits<double>::infinity());
+    for (std::size_t r = 0; r < table.n; r++) {
+        for (std::size_t s = r + 1; s < table.n; s++) table.delta[r][s] = table.full_delta(r, s);
+    }
+
+    return table;
+}
+
+// Robust tabu search (Taillard) over swaps of the placed characters, with the
+// deltas of the whole neighbourhood kept up to date in a SwapTable.
+//
+// Moving a character back to a key it left is tabu for a tenure drawn around
+// config.tenure. A tabu move is still taken if it beats the best score, or if
+// neither character has been near the other's key for config.aspiration
+// iterations.
+ChainResult tabu_chain(CompactLayout layout, const NgramTables &tables, const TabuConfig &config,
+                       const Constraints &constraints, std::mt19937_64 &rng) {
+    double score = score_layout(layout.positions, tables);
+    ChainResult best = {layout, score};
+
+    const std::vector<std::uint8_t> movable = movable_ids(layout.positions, tables.alphabet);
+    const std::size_t n = movable.size();
+    if (n < 2 || placed_bigram_total(layout.positions, tables) <= 0) return best;
+
+    SwapTable table = make_swap_table(layout, movable, tables);
+    const double scale = table.scale;
+
+    // tabu[i][pos]: last iteration on which character i may not move to pos.
+    // Staggered negative starts keep the first long-term aspirations apart.
+    std::array<std::array<std::int64_t, KEY_COUNT>, KEY_COUNT> tabu;
+    for (std::size_t i = 0; i < n; i++) {
+        for (std::size_t pos = 0; pos < KEY_COUNT; pos++) {
+            tabu[i][pos] = -static_cast<std::int64_t>(n * i + pos);
+        }
+    }
+
+    const std::size_t tenure = config.tenure == 0 ? n : config.tenure;
+    const std::int64_t aspiration = config.aspiration == 0 ? 5 * n * n : config.aspiration;
+    std::uniform_int_distribution<std::size_t> draw_tenure(tenure * 9 / 10, std::max(tenure * 11 / 10, tenure * 9 / 10));
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (std::int64_t iteration = 1;; iteration++) {
+        if (config.time_limit > 0) {
+            if ((iteration & 63) == 0) {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                if (elapsed.count() >= config.time_limit) break;
+            }
+        } else if (static_cast<std::uint64_t>(iteration) > config.iterations) {
+            break;
+        }
+
+        std::size_t move_r = n;
+        std::size_t move_s = n;
+        double move_delta = std::numeric_limits<double>::max();
+        bool aspired_move = false;
+        std::size_t ties = 0; // equal moves seen so far, one kept uniformly at random
+
+        for (std::size_t r = 0; r < n; r++) {
+            for (std::size_t s = r + 1; s < n; s++) {
+                if (!can_swap(constraints, layout.positions, movable[r], movable[s])) continue;
+                // no metric tells keys of one finger apart, so such a swap is a no-op
+                if (geometry.same_finger[pair_index(table.place[r], table.place[s])]) continue;
+
+                std::int64_t tabu_r = tabu[r][table.place[s]];
+                std::int64_t tabu_s = tabu[s][table.place[r]];
+
+                bool allowed = tabu_r < iteration || tabu_s < iteration;
+                bool aspired = tabu_r < iteration - aspiration || tabu_s < iteration - aspiration ||
+                               score + table.delta[r][s] * scale < best.score;
+
+                // aspired moves win over all others, then the smallest delta;
+                // ties are broken at random so zero-delta plateaus do not cycle
+                if (aspired != aspired_move ? !aspired : !(aspired || allowed) || table.delta[r][s] > move_delta)
+                    continue;
+                if (aspired == aspired_move && table.delta[r][s] == move_delta) {
+                    if (std::uniform_int_distribution<std::size_t>(0, ties++)(rng) != 0) continue;
+                } else {
+                    ties = 1;
+                }
+                move_r = r;
+                move_s = s;
+                move_delta = table.delta[r][s];
+                aspired_move = aspired;
+            }
+        }
+        if (move_r == n) continue;
+
+#ifdef LIU_CHECKED
+        check_swap_delta(layout, tables, movable[move_r], movable[move_s], move_delta * scale);
+#endif
+
+        swap_keys(layout, movable[move_r], movable[move_s]);
+        score += move_delta * scale;
+
+        tabu[move_r][table.place[move_r]] = iteration + draw_tenure(rng);
+        tabu[move_s][table.place[move_s]] = iteration + draw_tenure(rng);
+        table.swap(move_r, move_s);
+
+        if (score < best.score) best = {layout, score};
+    }
+
+    return best;
+}
+
+KeyboardLayout tabu_layout(KeyboardLayout layout, const NgramTables &tables, const TabuConfig &config,
+                           const Constraints &constraints) {
+    std::mt19937_64 rng(config.seed);
+    ChainResult best = tabu_chain(to_compact(layout, tables.alphabet), tables, config, constraints, rng);
+
+    apply_layout(layout, best.layout, tables.alphabet);
+    get_stats(layout, tables);
+    return layout;
+}
+
+// The smallest deltas[cell] + masks[cell] and the first cell holding it, in
+// one pass. The AVX2 path keeps a running minimum and its cell per lane and
+// reduces the four lanes at the end.
+std::size_t min_cell(const double *deltas, const double *masks, std::size_t cells, double &best) {
+    best = std::numeric_limits<double>::infinity();
+    std::size_t cell = 0;
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256d lane_best = _mm256_set1_pd(best);
+    __m256d lane_cell = _mm256_setzero_pd();
+    __m256d index = _mm256_setr_pd(0, 1, 2, 3);
+    const __m256d step = _mm256_set1_pd(4);
+
+    for (; i + 4 <= cells; i += 4) {
+        __m256d sum = _mm256_add_pd(_mm256_loadu_pd(deltas + i), _mm256_loadu_pd(masks + i));
+        __m256d lower = _mm256_cmp_pd(sum, lane_best, _CMP_LT_OQ);
+        lane_best = _mm256_blendv_pd(lane_best, sum, lower);
+        lane_cell = _mm256_blendv_pd(lane_cell, index, lower);
+        index = _mm256_add_pd(index, step);
+    }
+
+    alignas(32) double values[4];
+    alignas(32) double where[4];
+    _mm256_store_pd(values, lane_best);
+    _mm256_store_pd(where, lane_cell);
+    for (int lane = 0; lane < 4; lane++) {
+        auto lane_cell_index = static_cast<std::size_t>(where[lane]);
+        if (values[lane] < best || (values[lane] == best && lane_cell_index < cell)) {
+            best = values[lane];
+            cell = lane_cell_index;
+        }
+    }
+#endif
+
+    for (; i < cells; i++) {
+        double sum = deltas[i] + masks[i];
+        if (sum < best) {
+            best = sum;
+            cell = i;
+        }
+    }
+    return cell;
+}
+
+// Steepest descent: every step scans the deltas of the whole swap
+// neighbourhood as one flat buffer, takes the best swap, and stops when no
+// swap improves the score. Swaps the constraints forbid are masked with
+// +infinity; only the rows and columns of the two moved characters can
+// change legality after a step.
+ChainResult descend(CompactLayout layout, const NgramTables &tables,
+                    const Constraints &constraints) {
+    double score = score_layout(layout.positions, tables);
+
+    const std::vector<std::uint8_t> movable = movable_ids(layout.positions, tables.alphabet);
+    const std::size_t n = movable.size();
+    if (n < 2 || placed_bigram_total(layout.positions, tables) <= 0) return {layout, score};
+
+    SwapTable table = make_swap_table(layout, movable, tables);
+    const double scale = table.scale;
+
+    SwapTable::Matrix blocked{};
+    auto block = [&](std::size_t r, std::size_t s) {
+        bool legal = can_swap(constraints, layout.positions, movable[r], movable[s]);
+        blocked[r][s] = legal ? 0 : std::numeric_limits<double>::infinity();
+    };
+    for (std::size_t r = 0; r < n; r++) {
+        for (std::size_t s = r + 1; s < n; s++) block(r, s);
+    }
+
+    constexpr std::size_t CELLS = KEY_COUNT * KEY_COUNT;
+    const double *deltas = table.delta.front().data();
+    const double *masks = blocked.front().data();
+
+    while (true) {
+        double best;
+        std::size_t cell = min_cell(deltas, masks, CELLS, best);
+        if (!(best < 0)) break;
+
+        std::size_t r = cell / KEY_COUNT;
+        std::size_t s = cell % KEY_COUNT;
+
+#ifdef LIU_CHECKED
+        check_swap_delta(layout, tables, movable[r], movable[s], best * scale);
+#endif
+
+        swap_keys(layout, movable[r], movable[s]);
+        table.swap(r, s);
+        score += best * scale;
+
+        if (!constraints.unconstrained()) {
+            for (std::size_t i = 0; i < n; i++) {
+                for (std::size_t moved : {r, s}) {
+                    if (i < moved) block(i, moved);
+                    else if (moved < i) block(moved, i);
+                }
+            }
+        }
+    }
+
+    return {layout, score};
+}
+
+KeyboardLayout steepest_layout(KeyboardLayout layout, const NgramTables &tables,
+                               const Constraints &constraints) {
+    ChainResult best = descend(to_compact(layout, tables.alphabet), tables, constraints);
+
+    apply_layout(layout, best.layout, tables.alphabet);
+    get_stats(layout, tables);
+    return layout;
+}
+
+// Child of two layouts that place the same characters on the same set of
+// slots. A random segment of slots comes from first; PMX keeps second's keys
+// elsewhere, repairing by swaps, OX fills the other slots with the rest of
+// the characters in the order second has them, starting after the segment.
+void crossover(const CompactLayout &first, const CompactLayout &second, CompactLayout &child,
+               std::span<const std::uint8_t> slots, Crossover type, std::mt19937_64 &rng) {
+    std::uniform_int_distribution<std::size_t> pick(0, slots.size() - 1);
+    std::size_t begin = pick(rng);
+    std::size_t end = pick(rng);
+    if (begin > end) std::swap(begin, end);
+    end++;
+
+    if (type == Crossover::PMX) {
+        child = second;
+        for (std::size_t k = begin; k < end; k++) {
+            swap_keys(child, child.keys[slots[k]], first.keys[slots[k]]);
+        }
+        return;
+    }
+
+    child = first;
+    std::uint32_t used = 0; // ALPHABET_SIZE bits
+    for (std::size_t k = begin; k < end; k++) used |= 1u << first.keys[slots[k]];
+
+    std::size_t fill = end % slots.size();
+    for (std::size_t i = 0; i < slots.size(); i++) {
+        std::uint8_t id = second.keys[slots[(end + i) % slots.size()]];
+        if (used & (1u << id)) continue;
+
+        child.keys[slots[fill]] = id;
+        child.positions[id] = slots[fill];
+        fill = (fill + 1) % slots.size();
+    }
+}
+
+// Generational genetic algorithm over permutations of the placed characters:
+// tournament selection, PMX or OX crossover, a random swap as mutation, and
+// the best layout carried over unchanged. Both generations live in one arena
+// allocated up front, so the generation loop does not touch the heap. Each
+// thread breeds and scores its own slice of the next generation; a barrier
+// swaps the generations between rounds.
+ChainResult evolve(const CompactLayout &start, const NgramTables &tables, const GeneticConfig &config,
+                   const Constraints &constraints, ScoreCache *cache = nullptr) {
+    ChainResult best = {start, score_layout(start.positions, tables)};
+
+    const std::vector<std::uint8_t> movable = movable_ids(start.positions, tables.alphabet);
+    if (movable.size() < 2) return best;
+
+    std::vector<std::uint8_t> slots;
+    for (std::uint8_t id : movable) slots.push_back(start.positions[id]);
+    std::sort(slots.begin(), slots.end());
+
+    const bool constrained = !constraints.unconstrained();
+    const std::size_t population = std::max<std::size_t>(config.population, 2);
+    std::size_t threads = config.threads;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, population);
+
+    std::vector<CompactLayout> arena(2 * population);
+    std::vector<double> arena_fitness(2 * population);
+    CompactLayout *current = arena.data();
+    CompactLayout *next = current + population;
+    double *current_fitness = arena_fitness.data();
+    double *next_fitness = current_fitness + population;
+
+    std::uint64_t generation = 0;
+    bool done = false;
+    auto started = std::chrono::steady_clock::now();
+
+    // runs on one thread between rounds, while the others wait
+    auto next_generation = [&]() noexcept {
+        std::swap(current, next);
+        std::swap(current_fitness, next_fitness);
+
+        for (std::size_t i = 0; i < population; i++) {
+            if (current_fitness[i] < best.score) best = {current[i], current_fitness[i]};
+        }
+
+        if (config.time_limit > 0) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+            done = elapsed.count() >= config.time_limit;
+        } else {
+            done = generation++ >= config.generations;
+        }
+    };
+    std::barrier sync(threads, next_generation);
+
+    auto worker = [&](std::size_t thread) {
+        std::seed_seq seed{config.seed, static_cast<std::uint64_t>(thread)};
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<std::size_t> pick_parent(0, population - 1);
+        std::uniform_int_distribution<std::size_t> pick_gene(0, movable.size() - 1);
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+        const std::size_t begin = population * thread / threads;
+        const std::size_t end = population * (thread + 1) / threads;
+
+        // converged populations repeat layouts, which the cache scores once
+        CacheStats cache_stats;
+        auto fitness = [&](const CompactLayout &layout) {
+            if (!cache) return score_layout(layout.positions, tables);
+            std::uint64_t hash = layout_hash(layout);
+            if (std::optional<double> cached = cache->find(hash, cache_stats)) return *cached;
+
+            double score = score_layout(layout.positions, tables);
+            cache->store(hash, score);
+            return score;
+        };
+
+        auto select = [&]() -> const CompactLayout & {
+            std::size_t winner = pick_parent(rng);
+            for (std::size_t round = 1; round < config.tournament; round++) {
+                std::size_t challenger = pick_parent(rng);
+                if (current_fitness[challenger] < current_fitness[winner]) winner = challenger;
+            }
+            return current[winner];
+        };
+
+        // the first generation: the start layout and random restarts of it
+        for (std::size_t i = begin; i < end; i++) {
+            next[i] = start;
+            if (i > 0) shuffle_layout(next[i], movable, constraints, rng);
+            next_fitness[i] = fitness(next[i]);
+        }
+        sync.arrive_and_wait();
+
+        while (!done) {
+            for (std::size_t i = begin; i < end; i++) {
+                if (i == 0) {
+                    next[i] = best.layout;
+                    next_fitness[i] = best.score;
+                    continue;
+                }
+
+                const CompactLayout &first = select();
+                crossover(first, select(), next[i], slots, config.crossover, rng);
+                // crossover ignores constraints; an illegal child is replaced by its parent
+                if (constrained && !satisfies(constraints, next[i])) next[i] = first;
+
+                if (unit(rng) < config.mutation) {
+                    std::uint8_t id1 = movable[pick_gene(rng)];
+                    std::uint8_t id2 = movable[pick_gene(rng)];
+                    if (can_swap(constraints, next[i].positions, id1, id2)) swap_keys(next[i], id1, id2);
+                }
+                next_fitness[i] = fitness(next[i]);
+            }
+            sync.arrive_and_wait();
+        }
+        if (cache) cache->merge(cache_stats);
+    };
+
+    {
+        std::vector<std::jthread> pool;
+        for (std::size_t thread = 0; thread < threads; thread++) pool.emplace_back(worker, thread);
+    }
+
+    return best;
+}
+
+KeyboardLayout genetic_layout(KeyboardLayout layout, const NgramTables &tables, const GeneticConfig &config,
+                              const Constraints &constraints, ScoreCache *cache) {
+    ChainResult best = evolve(to_compact(layout, tables.alphabet), tables, config, constraints, cache);
+
+    apply_layout(layout, best.layout, tables.alphabet);
+    get_stats(layout, tables);
+    return layout;
+}
+
+// Exact branch and bound: places the characters of config.chars on the keys of
+// config.keys in the order with the lowest score, with every other character
+// fixed. Characters on those keys that are not being placed first move to the
+// keys the placed characters left, so the keys must all be occupied.
+//
+// The score splits into a fixed part, a linear part (a placed character
+// against the fixed ones) and a quadratic part (placed against placed).
+// Characters are assigned one at a time, most bigrams first. contrib[c][q] is
+// what putting unassigned character c on free key q adds given everything
+// assigned so far; the lower bound of a node is its cost plus the cheapest
+// contrib of every unassigned character, which is valid because costs are
+// never negative and ignores the pairs among the unassigned. Key costs are
+// shifted by their minimum over the chosen keys, which every assignment pays
+// alike, to keep them non-negative; a negative SFB weight or any trigram
+// weight breaks the bound and is rejected.
+std::expected<ExactResult, Error> exact_search(CompactLayout layout, const NgramTables &tables,
+                                               const ExactConfig &config,
+                                               const Constraints &constraints) {
+    const Alphabet &alphabet = tables.alphabet;
+    if (scoring.uses_trigrams || scoring.weights.sfb < 0) return std::unexpected(OPTION_ERROR_INVALID_ARGUMENT);
+    const PlacedTotals totals = placed_totals(layout.positions, tables);
+
+    std::vector<std::uint8_t> chars;
+    if (config.chars.empty()) {
+        std::vector<std::uint8_t> placed = movable_ids(layout.positions, alphabet);
+        std::stable_sort(placed.begin(), placed.end(), [&](std::uint8_t a, std::uint8_t b) {
+            return tables.monograms[a] > tables.monograms[b];
+        });
+        chars.assign(placed.begin(), placed.begin() + std::min<std::size_t>(10, placed.size()));
+    } else {
+        for (char ch : config.chars) chars.push_back(alphabet.id(ch));
+    }
+
+    std::vector<std::uint8_t> keys;
+    if (config.keys.empty()) {
+        for (std::uint8_t pos = 10; pos < 20; pos++) keys.push_back(pos);
+    } else {
+        for (char ch : config.keys) {
+            std::uint8_t id = alphabet.id(ch);
+            keys.push_back(id == NO_CHAR ? NO_POSITION : layout.positions[id]);
+        }
+    }
+
+    const std::size_t m = chars.size();
+    std::uint32_t char_mask = 0;
+    std::uint32_t key_mask = 0;
+    for (std::uint8_t id : chars) {
+        if (id == NO_CHAR || layout.positions[id] == NO_POSITION || (char_mask & (1u << id)))
+            return std::unexpected(OPTION_ERROR_INVALID_ARGUMENT);
+        char_mask |= 1u << id;
+    }
+    for (std::uint8_t pos : keys) {
+        if (pos == NO_POSITION || layout.keys[pos] == NO_CHAR || (key_mask & (1u << pos)))
+            return std::unexpected(OPTION_ERROR_INVALID_ARGUMENT);
+        key_mask |= 1u << pos;
+    }
+    if (m == 0 || keys.size() != m) return std::unexpected(OPTION_ERROR_INVALID_ARGUMENT);
+
+    // clear the chosen keys, moving whoever else is on them to the freed keys
+    std::vector<std::uint8_t> freed;
+    for (std::uint8_t id : chars) {
+        if (!(key_mask & (1u << layout.positions[id]))) freed.push_back(layout.positions[id]);
+        layout.keys[layout.positions[id]] = NO_CHAR;
+        layout.positions[id] = NO_POSITION;
+    }
+    std::size_t next_freed = 0;
+    for (std::uint8_t pos : keys) {
+        std::uint8_t id = layout.keys[pos];
+        if (id == NO_CHAR) continue; // one of the placed characters, already lifted
+        layout.keys[freed[next_freed]] = id;
+        layout.positions[id] = freed[next_freed++];
+        layout.keys[pos] = NO_CHAR;
+        if (!constraints.allows(id, layout.positions[id])) return std::unexpected(CONSTRAINT_ERROR_UNSATISFIED);
+    }
+
+    // most connected characters first, so bounds tighten early
+    auto weight = [&](std::uint8_t a, std::uint8_t b) -> double {
+        return tables.bigrams[bigram_index(a, b)] + tables.bigrams[bigram_index(b, a)];
+    };
+    std::vector<double> strength(ALPHABET_SIZE);
+    for (std::uint8_t id : chars) {
+        for (std::uint8_t other = 0; other < alphabet.size; other++) {
+            if (other != id) strength[id] += weight(id, other);
+        }
+    }
+    std::stable_sort(chars.begin(), chars.end(),
+                     [&](std::uint8_t a, std::uint8_t b) { return strength[a] > strength[b]; });
+
+    // key costs in bigram units, like the rest of contrib
+    const double key_scale = totals.monograms > 0 ? totals.bigrams / totals.monograms : 0;
+    double cheapest_key = std::numeric_limits<double>::max();
+    for (std::uint8_t pos : keys) cheapest_key = std::min(cheapest_key, scoring.key_cost[pos]);
+
+    // contrib for every depth: [depth][char index][key index]
+    using Contrib = std::array<std::array<double, KEY_COUNT>, KEY_COUNT>;
+    std::vector<Contrib> contrib(m + 1);
+    for (std::size_t c = 0; c < m; c++) {
+        for (std::size_t k = 0; k < m; k++) {
+            // a forbidden key costs infinitely much, so no bound ever admits it
+            if (!constraints.allows(chars[c], keys[k])) {
+                contrib[0][c][k] = std::numeric_limits<double>::infinity();
+                continue;
+            }
+
+            double cost = 0;
+            if (scoring.uses_keys) {
+                cost = tables.monograms[chars[c]] * key_scale * (scoring.key_cost[keys[k]] - cheapest_key);
+            }
+            for (std::uint8_t other = 0; other < alphabet.size; other++) {
+                std::uint8_t pos = layout.positions[other];
+                if (pos == NO_POSITION || other == chars[c]) continue;
+                cost += weight(chars[c], other) * scoring.pair_cost[pair_index(keys[k], pos)];
+            }
+            contrib[0][c][k] = cost;
+        }
+    }
+
+    ExactResult result;
+    std::array<std::uint8_t, KEY_COUNT> assigned{};
+    std::array<std::uint8_t, KEY_COUNT> best_assigned{};
+    double best_cost = std::numeric_limits<double>::max();
+
+    auto search = [&](auto &self, std::size_t depth, std::uint32_t free, double cost) -> void {
+        result.nodes++;
+        if (depth == m) {
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_assigned = assigned;
+            }
+            return;
+        }
+
+        const Contrib &here = contrib[depth];
+        Contrib &below = contrib[depth + 1];
+
+        std::array<std::uint8_t, KEY_COUNT> order;
+        std::size_t count = 0;
+        for (std::size_t k = 0; k < m; k++) {
+            if (free & (1u << k)) order[count++] = k;
+        }
+        std::sort(order.begin(), order.begin() + count,
+                  [&](std::uint8_t a, std::uint8_t b) { return here[depth][a] < here[depth][b]; });
+
+        for (std::size_t i = 0; i < count; i++) {
+            std::size_t k = order[i];
+            double placed_cost = cost + here[depth][k];
+            if (placed_cost >= best_cost) break; // the rest cost at least as much
+
+            std::uint32_t rest = free & ~(1u << k);
+            double bound = placed_cost;
+            for (std::size_t c = depth + 1; c < m && bound < best_cost; c++) {
+                double w = weight(chars[c], chars[depth]);
+                double cheapest = std::numeric_limits<double>::max();
+                for (std::size_t q = 0; q < m; q++) {
+                    if (!(rest & (1u << q))) continue;
+                    below[c][q] = here[c][q] + w * scoring.pair_cost[pair_index(keys[q], keys[k])];
+                    cheapest = std::min(cheapest, below[c][q]);
+                }
+                bound += cheapest;
+            }
+            if (bound >= best_cost) continue;
+
+            assigned[depth] = k;
+            self(self, depth + 1, rest, placed_cost);
+        }
+    };
+    search(search, 0, (1u << m) - 1, 0);
+    if (best_cost == std::numeric_limits<double>::max()) return std::unexpected(CONSTRAINT_ERROR_UNSATISFIED);
+
+    for (std::size_t c = 0; c < m; c++) {
+        layout.keys[keys[best_assigned[c]]] = chars[c];
+        layout.positions[chars[c]] = keys[best_assigned[c]];
+    }
+    result.best = {layout, score_layout(layout.positions, tables)};
+    return result;
+}
+
+// Lowers best to score unless another thread already got below it. Returns
+// whether score became the new best.
+bool update_best(std::atomic<double> &best, double score) {
+    double current = best.load(std::memory_order_relaxed);
+    while (score < current) {
+        if (best.compare_exchange_weak(current, score, std::memory_order_relaxed)) return true;
+    }
+    return false;
+}
+
+// Runs independent annealing chains from random restarts of the layout on a
+// pool of threads. Every chain has its own RNG stream and layout state and
+// writes only its own result slot; the best score is shared lock-free, and a
+// chain that beats it reports its score on stderr so long runs show progress.
+// Returns the best distinct layouts, best first.
+//
+// Under dedupe, when nothing tells a layout from its mirror (no constraints,
+// equal hand weights), the chains search one orientation only: the most
+// frequent movable character stays on the hand it starts on, which halves the
+// search space and loses no layout up to mirroring.
+std::vector<KeyboardLayout> parallel_layouts(const KeyboardLayout &layout, const NgramTables &tables,
+                                             const AnnealConfig &anneal, const ParallelConfig &config,
+                                             const Constraints &constraints,
+                                             ScoreCache *cache) {
+    std::size_t threads = config.threads;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t chains = config.chains == 0 ? threads : config.chains;
+    threads = std::min(threads, chains);
+
+    const CompactLayout start = to_compact(layout, tables.alphabet);
+    const std::vector<std::uint8_t> movable = movable_ids(start.positions, tables.alphabet);
+
+    Constraints search = constraints;
+    if (config.dedupe != Dedupe::NONE && constraints.unconstrained() && !movable.empty() &&
+        scoring.weights.left_hand == scoring.weights.right_hand) {
+        std::uint8_t pinned = *std::max_element(movable.begin(), movable.end(), [&](std::uint8_t a, std::uint8_t b) {
+            return tables.monograms[a] < tables.monograms[b];
+        });
+        Hand hand = geometry.keys[start.positions[pinned]].hand;
+        for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+            if (geometry.keys[pos].hand != hand) search.allowed[pos] &= ~(1u << pinned);
+        }
+    }
+
+    std::vector<ChainResult> results(chains);
+    std::atomic<std::size_t> next_chain = 0;
+    std::atomic<double> best_score = std::numeric_limits<double>::max();
+
+    auto worker = [&] {
+        for (std::size_t chain = next_chain++; chain < chains; chain = next_chain++) {
+            std::seed_seq seed{anneal.seed, static_cast<std::uint64_t>(chain)};
+            std::mt19937_64 rng(seed);
+
+            // restart from a random permutation of the placed characters
+            CompactLayout restart = start;
+            shuffle_layout(restart, movable, search, rng);
+
+            results[chain] = anneal_chain(restart, tables, anneal, search, rng, cache);
+            if (update_best(best_score, results[chain].score)) {
+                std::osyncstream(std::cerr) << "chain " << chain << ": new best " << results[chain].score << "\n";
+            }
+        }
+    };
+
+    {
+        std::vector<std::jthread> pool;
+        for (std::size_t i = 0; i < threads; i++) pool.emplace_back(worker);
+    }
+
+    std::sort(results.begin(), results.end(),
+              [](const ChainResult &a, const ChainResult &b) { return a.score < b.score; });
+
+    std::vector<KeyboardLayout> best;
+    std::vector<Positions> seen;
+    for (const ChainResult &result : results) {
+        if (best.size() == config.top) break;
+        Positions canonical = canonical_layout(result.layout, config.dedupe).positions;
+        if (std::find(seen.begin(), seen.end(), canonical) != seen.end()) continue;
+        seen.push_back(canonical);
+
+        KeyboardLayout candidate = layout;
+        apply_layout(candidate, result.layout, tables.alphabet);
+        get_stats(candidate, tables);
+        best.push_back(candidate);
+    }
+
+    return best;
+}
+
+std::expected<Options, Error> parse_options(int argc, char **argv) {
+    Options options;
+
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc) return std::unexpected(OPTION_ERROR_INVALID_ARGUMENT);
+        std::string_view value = argv[++i];
+
+        bool valid = true;
+        if (arg == "--layout") options.layout = value;
+        else if (arg == "--corpus") options.corpus = value;
+        else if (arg == "--text") options.text = value;
+        else if (arg == "--socket") options.socket = value;
+        else if (arg == "--constraints") options.constraints = value;
+        else if (arg == "--weights") options.weights = value;
+        else if (arg == "--cache") valid = parse_number(value, options.cache);
+        else if (arg == "--mode") {
+            options.mode = value;
+            valid = value == "greedy" || value == "anneal" || value == "tabu" || value == "genetic" ||
+                    value == "exact" || value == "steepest" || value == "parallel";
+        }
+        // the search budget and seed apply to whichever mode runs
+        else if (arg == "--iterations") {
+            // annealing divides its schedule by the budget
+            valid = parse_number(value, options.anneal.iterations) && parse_number(value, options.tabu.iterations) &&
+                    options.anneal.iterations > 0;
+        }
+        else if (arg == "--time") {
+            valid = parse_number(value, options.anneal.time_limit) && parse_number(value, options.tabu.time_limit) &&
+                    parse_number(value, options.genetic.time_limit);
+        }
+        else if (arg == "--seed") {
+            valid = parse_number(value, options.anneal.seed) && parse_number(value, options.tabu.seed) &&
+                    parse_number(value, options.genetic.seed);
+        }
+        else if (arg == "--start-temp") valid = parse_number(value, options.anneal.start_temperature);
+        else if (arg == "--end-temp") valid = parse_number(value, options.anneal.end_temperature);
+        else if (arg == "--schedule") {
+            if (value == "exp") options.anneal.schedule = Schedule::EXPONENTIAL;
+            else if (value == "linear") options.anneal.schedule = Schedule::LINEAR;
+            else if (value == "none") options.anneal.schedule = Schedule::NONE;
+            else valid = false;
+        }
+        else if (arg == "--tenure") valid = parse_number(value, options.tabu.tenure);
+        else if (arg == "--aspiration") valid = parse_number(value, options.tabu.aspiration);
+        else if (arg == "--population") valid = parse_number(value, options.genetic.population);
+        else if (arg == "--generations") valid = parse_number(value, options.genetic.generations);
+        else if (arg == "--tournament") valid = parse_number(value, options.genetic.tournament) && options.genetic.tournament > 0;
+        else if (arg == "--mutation") valid = parse_number(value, options.genetic.mutation);
+        else if (arg == "--crossover") {
+            if (value == "pmx") options.genetic.crossover = Crossover::PMX;
+            else if (value == "ox") options.genetic.crossover = Crossover::OX;
+            else valid = false;
+        }
+        else if (arg == "--chars") options.exact.chars = value;
+        else if (arg == "--keys") options.exact.keys = value;
+        else if (arg == "--chains") valid = parse_number(value, options.parallel.chains);
+        else if (arg == "--threads") {
+            valid = parse_number(value, options.parallel.threads) && parse_number(value, options.genetic.threads);
+        }
+        else if (arg == "--top") valid = parse_number(value, options.parallel.top);
+        else if (arg == "--dedupe") {
+            if (value == "none") options.parallel.dedupe = Dedupe::NONE;
+            else if (value == "mirror") options.parallel.dedupe = Dedupe::MIRROR;
+            else if (value == "fingers") options.parallel.dedupe = Dedupe::FINGERS;
+            else valid = false;
+        }
+        else valid = false;
+
+        if (!valid) return std::unexpected(OPTION_ERROR_INVALID_ARGUMENT);
+    }
+
+    if (options.anneal.start_temperature <= 0 || options.anneal.end_temperature <= 0)
+        return std::unexpected(OPTION_ERROR_INVALID_ARGUMENT);
+
+    return options;
+}
+
+bool parse_range(std::string_view text, int limit, int &first, int &last) {
+    std::size_t dash = text.find('-');
+    if (!parse_number(text.substr(0, dash), first)) return false;
+    last = first;
+    if (dash != std::string_view::npos && !parse_number(text.substr(dash + 1), last)) return false;
+    return 0 <= first && first <= last && last < limit;
+}
+
+// Reads a constraint file, one rule per line, '#' starting a comment:
+//   pin CHARS                     keep CHARS on their keys in layout
+//   row ROWS CHARS                keep CHARS on rows ROWS (0 top to 2 bottom)
+//   hand left|right CHARS         keep CHARS on one hand
+//   region ROWS COLUMNS CHARS     keep CHARS inside a block of keys
+// ROWS and COLUMNS are a number or a range like 0-4. Rules on the same
+// character intersect.
+std::expected<Constraints, Error> load_constraints(const std::filesystem::path &file, const CompactLayout &layout,
+                                                   const Alphabet &alphabet) {
+    std::ifstream in(file);
+    if (!in) return std::unexpected(CONSTRAINT_ERROR_INVALID_FILE);
+
+    Constraints constraints;
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string rule, chars;
+        if (!(words >> rule)) continue;
+
+        int row_first = 0, row_last = 2, col_first = 0, col_last = 9;
+        bool pin = false;
+        bool valid = true;
+
+        if (rule == "pin") {
+            pin = true;
+        } else if (rule == "row") {
+            std::string rows;
+            valid = words >> rows && parse_range(rows, 3, row_first, row_last);
+        } else if (rule == "hand") {
+            std::string hand;
+            valid = static_cast<bool>(words >> hand);
+            if (hand == "left") col_last = 4;
+            else if (hand == "right") col_first = 5;
+            else valid = false;
+        } else if (rule == "region") {
+            std::string rows, columns;
+            valid = words >> rows >> columns && parse_range(rows, 3, row_first, row_last) &&
+                    parse_range(columns, 10, col_first, col_last);
+        } else {
+            valid = false;
+        }
+
+        std::string extra;
+        if (!valid || !(words >> chars) || words >> extra) return std::unexpected(CONSTRAINT_ERROR_INVALID_FILE);
+
+        for (char ch : chars) {
+            std::uint8_t id = alphabet.id(ch);
+            if (id == NO_CHAR) return std::unexpected(CONSTRAINT_ERROR_INVALID_FILE);
+
+            for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+                int row = pos / 10;
+                int col = pos % 10;
+                bool inside = pin ? layout.positions[id] == pos
+                                  : row_first <= row && row <= row_last && col_first <= col && col <= col_last;
+                if (!inside) constraints.allowed[pos] &= ~(1u << id);
+            }
+        }
+    }
+
+    return constraints;
+}
+
+// Reads a weights file, one "METRIC WEIGHT" line per weighted metric, '#'
+// starting a comment. Metrics are named like the LayoutStats fields; the ones
+// not listed weigh 0, sfb included.
+std::expected<Weights, Error> load_weights(const std::filesystem::path &file) {
+    std::ifstream in(file);
+    if (!in) return std::unexpected(WEIGHTS_ERROR_INVALID_FILE);
+
+    Weights weights;
+    weights.sfb = 0;
+
+    const std::pair<std::string_view, double Weights::*> metrics[] = {
+        {"alternate", &Weights::alternate}, {"roll_in", &Weights::roll_in},
+        {"roll_out", &Weights::roll_out},   {"oneh_in", &Weights::oneh_in},
+        {"oneh_out", &Weights::oneh_out},   {"redirect", &Weights::redirect},
+        {"bad_redirect", &Weights::bad_redirect}, {"sfb", &Weights::sfb},
+        {"dsfb_red", &Weights::dsfb_red},   {"dsfb_alt", &Weights::dsfb_alt},
+        {"left_hand", &Weights::left_hand}, {"right_hand", &Weights::right_hand},
+    };
+
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string name, value, extra;
+        if (!(words >> name)) continue;
+        if (!(words >> value) || words >> extra) return std::unexpected(WEIGHTS_ERROR_INVALID_FILE);
+
+        auto metric = std::find_if(std::begin(metrics), std::end(metrics),
+                                   [&](const auto &entry) { return entry.first == name; });
+        if (metric == std::end(metrics) || !parse_number(value, weights.*metric->second))
+            return std::unexpected(WEIGHTS_ERROR_INVALID_FILE);
+    }
+
+    return weights;
+}
+
+// Installs the weights of --weights as the scoring kernel. Must run before any
+// layout is scored.
+bool use_weights(const Options &options) {
+    if (options.weights.empty()) return true;
+
+    auto weights = load_weights(options.weights);
+    if (!weights) {
+        std::cerr << options.weights << ": " << error_message(weights.error()) << "\n";
+        return false;
+    }
+    scoring = make_kernel(*weights);
+    return true;
+}
+
+// Moves as few characters as possible so that layout satisfies constraints,
+// keeping the same keys occupied: a minimum-cost assignment of the placed
+// characters to those keys (the Hungarian method), where staying costs 0,
+// moving 1 and a forbidden key more than moving everything. Returns the
+// number of characters moved.
+std::expected<std::size_t, Error> repair_layout(CompactLayout &layout, const Constraints &constraints,
+                                                const Alphabet &alphabet) {
+    if (satisfies(constraints, layout)) return 0;
+
+    const std::vector<std::uint8_t> chars = movable_ids(layout.positions, alphabet);
+    const std::size_t n = chars.size();
+    std::vector<std::uint8_t> keys(n);
+    for (std::size_t c = 0; c < n; c++) keys[c] = layout.positions[chars[c]];
+
+    const int forbidden = static_cast<int>(n) + 1;
+    auto cost = [&](std::size_t c, std::size_t k) {
+        if (!constraints.allows(chars[c], keys[k])) return forbidden;
+        return c == k ? 0 : 1;
+    };
+
+    // 1-based potentials and assignment, index 0 being the sentinel column:
+    // owner[k] is the character given key k
+    constexpr int INF = std::numeric_limits<int>::max();
+    std::vector<int> u(n + 1), v(n + 1);
+    std::vector<std::size_t> owner(n + 1), way(n + 1);
+    for (std::size_t c = 1; c <= n; c++) {
+        owner[0] = c;
+        std::size_t k0 = 0;
+        std::vector<int> slack(n + 1, INF);
+        std::vector<bool> used(n + 1, false);
+        do {
+            used[k0] = true;
+            std::size_t c0 = owner[k0], k1 = 0;
+            int delta = INF;
+            for (std::size_t k = 1; k <= n; k++) {
+                if (used[k]) continue;
+                int reduced = cost(c0 - 1, k - 1) - u[c0] - v[k];
+                if (reduced < slack[k]) {
+                    slack[k] = reduced;
+                    way[k] = k0;
+                }
+                if (slack[k] < delta) {
+                    delta = slack[k];
+                    k1 = k;
+                }
+            }
+            for (std::size_t k = 0; k <= n; k++) {
+                if (used[k]) {
+                    u[owner[k]] += delta;
+                    v[k] -= delta;
+                } else {
+                    slack[k] -= delta;
+                }
+            }
+            k0 = k1;
+        } while (owner[k0] != 0);
+        do {
+            std::size_t k1 = way[k0];
+            owner[k0] = owner[k1];
+            k0 = k1;
+        } while (k0 != 0);
+    }
+
+    std::size_t moved = 0;
+    for (std::size_t k = 1; k <= n; k++) {
+        std::size_t c = owner[k] - 1;
+        if (cost(c, k - 1) == forbidden) return std::unexpected(CONSTRAINT_ERROR_UNSATISFIED);
+        moved += c != k - 1;
+    }
+    for (std::size_t k = 1; k <= n; k++) {
+        std::uint8_t id = chars[owner[k] - 1];
+        layout.keys[keys[k - 1]] = id;
+        layout.positions[id] = keys[k - 1];
+    }
+    return moved;
+}
+
+void print_usage() {
+    std::cerr << "usage: liu corpus compile PATH NAME [--threads N] [--layouts DIRECTORY|LIST_FILE]\n"
+                 "       liu batch DIRECTORY|LIST_FILE [--corpus NAME | --text PATH] [--threads N]\n"
+                 "                 [--dedupe none|mirror|fingers] [--weights FILE]\n"
+                 "       liu serve [--socket PATH] [--corpus NAME | --text PATH] [--weights FILE]\n"
+                 "       liu [--layout NAME] [--corpus NAME | --text PATH] [--constraints FILE]\n"
+                 "           [--weights FILE]\n"
+                 "           [--mode greedy|steepest|anneal|tabu|genetic|exact|parallel]\n"
+                 "           [--iterations N] [--time SECONDS] [--seed N]\n"
+                 "           [--start-temp T] [--end-temp T] [--schedule exp|linear|none]\n"
+                 "           [--tenure N] [--aspiration N]\n"
+                 "           [--population N] [--generations N] [--tournament N]\n"
+                 "           [--mutation P] [--crossover pmx|ox]\n"
+                 "           [--chars CHARS] [--keys KEYS_BY_CURRENT_CHAR]\n"
+                 "           [--chains N] [--threads N] [--top K] [--cache SLOTS]\n"
+                 "           [--dedupe none|mirror|fingers]\n";
+}
+
+// Layout files to evaluate: every regular file below a directory, or the
+// files listed one per line in a list file, relative to the list's directory.
+std::expected<std::vector<std::filesystem::path>, Error> batch_files(const std::filesystem::path &path) {
+    std::vector<std::filesystem::path> files;
+    std::error_code error;
+
+    if (std::filesystem::is_directory(path, error)) {
+        // as in count_path, nothing here may throw
+        std::filesystem::recursive_directory_iterator entry(path, error), end;
+        for (; !error && entry != end; entry.increment(error)) {
+            std::error_code entry_error;
+            if (entry->is_regular_file(entry_error) && !entry_error) files.push_back(entry->path());
+        }
+        if (error) return std::unexpected(LAYOUT_PARSE_ERROR_INVALID_FILE);
+    } else {
+        std::ifstream list(path);
+        if (!list) return std::unexpected(LAYOUT_PARSE_ERROR_INVALID_FILE);
+
+        std::string line;
+        while (std::getline(list, line)) {
+            if (line.empty()) continue;
+            files.push_back(path.parent_path() / line);
+        }
+    }
+
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// liu corpus compile PATH NAME [--threads N] [--layouts DIRECTORY|LIST_FILE]:
+// counts a text file or directory of text files into ../corpus/NAME.liu, for
+// the default alphabet and every character the given layouts place.
+int compile_corpus(int argc, char **argv) {
+    if (argc < 4 || argc % 2 != 0 || std::string_view(argv[1]) != "compile") {
+        print_usage();
+        return 1;
+    }
+
+    std::size_t threads = 0;
+    std::string placed;
+    for (int i = 4; i < argc; i += 2) {
+        std::string_view arg = argv[i];
+        bool valid = true;
+        if (arg == "--threads") {
+            valid = parse_number(std::string_view(argv[i + 1]), threads);
+        } else if (arg == "--layouts") {
+            auto files = batch_files(argv[i + 1]);
+            if (!files) {
+                std::cerr << argv[i + 1] << ": " << error_message(files.error()) << "\n";
+                return 1;
+            }
+            for (const auto &file : *files) {
+                if (auto layout = load_layout_file(file)) placed += alpha_chars(*layout);
+            }
+        } else {
+            valid = false;
+        }
+
+        if (!valid) {
+            print_usage();
+            return 1;
+        }
+    }
+
+    auto tables = count_path(argv[2], layout_alphabet(placed), threads);
+    if (!tables) {
+        std::cerr << argv[2] << ": " << error_message(tables.error()) << "\n";
+        return 1;
+    }
+
+    if (auto written = write_corpus(corpus_path(argv[3]), **tables); !written) {
+        std::cerr << corpus_path(argv[3]) << ": " << error_message(written.error()) << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+// Raw text is counted for the characters in placed as well; a compiled corpus
+// has the alphabet it was compiled with.
+std::optional<LoadedCorpus> load_corpus(const Options &options, std::string_view placed) {
+    LoadedCorpus corpus;
+
+    if (!options.text.empty()) {
+        auto result = count_path(options.text, layout_alphabet(placed), options.parallel.threads);
+        if (!result) {
+            std::cerr << options.text << ": " << error_message(result.error()) << "\n";
+            return std::nullopt;
+        }
+        corpus.counted = std::move(*result);
+        corpus.tables = corpus.counted.get();
+    } else {
+        auto result = map_corpus(corpus_path(options.corpus));
+        if (!result) {
+            std::cerr << corpus_path(options.corpus) << ": " << error_message(result.error())
+                      << " (build it with liu corpus compile)\n";
+            return std::nullopt;
+        }
+        corpus.mapped = std::move(*result);
+        corpus.tables = corpus.mapped->tables;
+    }
+
+    return corpus;
+}
+
+struct BatchEntry {
+    std::filesystem::path file;
+    KeyboardLayout layout;
+    LayoutStats stats;
+    bool loaded = false;
+    Error error = LAYOUT_PARSE_ERROR_INVALID_FILE; // why it was not loaded
+    std::string unscored;                          // characters outside the corpus alphabet
+};
+
+// Loads and scores every layout on a pool of threads against one corpus. A
+// layout with characters the corpus does not count is not scored, since its
+// score would leave them out.
+std::vector<BatchEntry> evaluate_batch(const std::vector<std::filesystem::path> &files,
+                                       const NgramTables &tables, std::size_t threads) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max<std::size_t>(1, std::min(threads, files.size()));
+
+    std::vector<BatchEntry> entries(files.size());
+    std::atomic<std::size_t> next = 0;
+
+    auto worker = [&] {
+        for (std::size_t i = next++; i < files.size(); i = next++) {
+            BatchEntry &entry = entries[i];
+            entry.file = files[i];
+
+            auto layout = load_layout_file(files[i]);
+            if (!layout) continue;
+
+            entry.unscored = unscored_chars(*layout, tables.alphabet);
+            if (!entry.unscored.empty()) {
+                entry.error = LAYOUT_ERROR_UNSCORED_CHARS;
+                continue;
+            }
+
+            entry.layout = std::move(*layout);
+            entry.stats = get_stats(entry.layout, tables);
+            entry.loaded = true;
+        }
+    };
+
+    {
+        std::vector<std::jthread> pool;
+        for (std::size_t i = 0; i < threads; i++) pool.emplace_back(worker);
+    }
+
+    return entries;
+}
+
+// Under dedupe, only the first of a class of equivalent layouts is ranked.
+void print_leaderboard(std::vector<BatchEntry> &entries, const Alphabet &alphabet, Dedupe dedupe) {
+    std::stable_sort(entries.begin(), entries.end(), [](const BatchEntry &a, const BatchEntry &b) {
+        if (a.loaded != b.loaded) return a.loaded;
+        return a.layout.score < b.layout.score;
+    });
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::setw(6) << "#" << "  " << std::left << std::setw(24) << "Layout" << std::right
+              << std::setw(8) << "Score" << std::setw(8) << "SFB" << std::setw(8) << "SFS"
+              << std::setw(8) << "Alt" << std::setw(8) << "Rol" << std::setw(8) << "Red" << "\n";
+
+    std::size_t rank = 1;
+    std::size_t collapsed = 0;
+    std::unordered_set<std::string> seen;
+    for (const BatchEntry &entry : entries) {
+        if (!entry.loaded) {
+            std::cerr << entry.file.string() << ": " << error_message(entry.error);
+            if (!entry.unscored.empty()) std::cerr << " (" << entry.unscored << ")";
+            std::cerr << "\n";
+            continue;
+        }
+
+        if (dedupe != Dedupe::NONE) {
+            CompactLayout canonical = canonical_layout(to_compact(entry.layout, alphabet), dedupe);
+            if (!seen.emplace(canonical.keys.begin(), canonical.keys.end()).second) {
+                collapsed++;
+                continue;
+            }
+        }
+
+        const LayoutStats &stats = entry.stats;
+        std::cout << std::setw(6) << rank++ << "  " << std::left << std::setw(24) << entry.layout.name
+                  << std::right << std::setw(8) << entry.layout.score << std::setw(8) << stats.sfb
+                  << std::setw(8) << stats.dsfb_red + stats.dsfb_alt << std::setw(8) << stats.alternate
+                  << std::setw(8) << stats.roll_in + stats.roll_out
+                  << std::setw(8) << stats.redirect + stats.bad_redirect << "\n";
+    }
+    if (collapsed > 0) std::cout << collapsed << " equivalent layouts collapsed\n";
+}
+
+// liu batch PATH [options]: ranks every layout below a directory, or listed
+// in a file, against one corpus.
+int batch_command(int argc, char **argv) {
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+
+    // the batch path takes the place of the program name for parse_options
+    auto options = parse_options(argc - 1, argv + 1);
+    if (!options) {
+        print_usage();
+        return 1;
+    }
+    if (!use_weights(*options)) return 1;
+
+    auto files = batch_files(argv[1]);
+    if (!files) {
+        std::cerr << argv[1] << ": " << error_message(files.error()) << "\n";
+        return 1;
+    }
+
+    // raw text is counted for every character the layouts place
+    std::string placed;
+    if (!options->text.empty()) {
+        for (const auto &file : *files) {
+            if (auto layout = load_layout_file(file)) placed += alpha_chars(*layout);
+        }
+    }
+
+    auto corpus = load_corpus(*options, placed);
+    if (!corpus) return 1;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<BatchEntry> entries = evaluate_batch(*files, *corpus->tables, options->parallel.threads);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    print_leaderboard(entries, corpus->tables->alphabet, options->parallel.dedupe);
+    std::cout << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() << " ns\n";
+    return 0;
+}
+
+ServeResponse serve_request(const ServeRequest &request, const NgramTables &tables) {
+    ServeResponse response;
+    if (request.op != SERVE_OP_EVALUATE) return response;
+
+    CompactLayout layout;
+    layout.keys.fill(NO_CHAR);
+    layout.positions.fill(NO_POSITION);
+
+    for (std::uint8_t pos = 0; pos < KEY_COUNT; pos++) {
+        if (request.keys[pos] == '\0') continue;
+        // a character the corpus does not count could not be scored
+        std::uint8_t id = tables.alphabet.id(request.keys[pos]);
+        if (id == NO_CHAR) return response;
+        if (layout.positions[id] != NO_POSITION) return response;
+
+        layout.keys[pos] = id;
+        layout.positions[id] = pos;
+    }
+
+    response.status = SERVE_STATUS_OK;
+    response.stats = get_stats(layout.positions, tables);
+    response.score = layout_score(response.stats);
+    return response;
+}
+
+bool read_full(int fd, void *data, std::size_t size) {
+    auto *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t got = read(fd, bytes, size);
+        if (got <= 0) return false;
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void *data, std::size_t size) {
+    const auto *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// liu serve: keeps the corpus tables resident and answers evaluation requests
+// on a Unix domain socket, one thread per connection.
+int serve_command(int argc, char **argv) {
+    auto options = parse_options(argc, argv);
+    if (!options) {
+        print_usage();
+        return 1;
+    }
+    if (!use_weights(*options)) return 1;
+
+    auto corpus = load_corpus(*options);
+    if (!corpus) return 1;
+    const NgramTables &tables = *corpus->tables;
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (options->socket.size() >= sizeof(address.sun_path)) {
+        std::cerr << options->socket << ": socket path too long\n";
+        return 1;
+    }
+    std::copy(options->socket.begin(), options->socket.end(), address.sun_path);
+
+    // only a stale socket is replaced: one nobody listens on any more. A live
+    // server's socket and any other file at the path are left alone.
+    struct stat existing;
+    if (lstat(options->socket.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            std::cerr << options->socket << ": exists and is not a socket\n";
+            return 1;
+        }
+
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool stale = probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 &&
+                     errno == ECONNREFUSED;
+        if (probe >= 0) close(probe);
+        if (!stale) {
+            std::cerr << options->socket << ": already in use\n";
+            return 1;
+        }
+        unlink(options->socket.c_str());
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+        listen(server, SOMAXCONN) < 0) {
+        std::cerr << options->socket << ": could not listen\n";
+        return 1;
+    }
+    std::cerr << "listening on " << options->socket << "\n";
+
+    while (true) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) continue;
+
+        std::thread([client, &tables] {
+            ServeRequest request;
+            while (read_full(client, &request, sizeof(request))) {
+                ServeResponse response = serve_request(request, tables);
+                if (!write_full(client, &response, sizeof(response))) break;
+            }
+            close(client);
+        }).detach();
+    }
+}
 
 void debug_finger_assignments(const KeyboardLayout &layout) {
     std::cout << "Finger assignments:\n";
@@ -0,0 +1,761 @@
+// Shared by the liu and liu_bench executables: corpus loading, the scoring
+// kernel and the optimizers, implemented in v2.cpp.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <barrier>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <execution>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <random>
+#include <set>
+#include <span>
+#include <sstream>
+#include <syncstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/mman.h>
+
+enum Error {
+    LAYOUT_PARSE_ERROR_INVALID_FILE,
+    CORPUS_ERROR_INVALID_FILE,
+    CORPUS_ERROR_INVALID_FORMAT,
+    CORPUS_ERROR_CHECKSUM_MISMATCH,
+    OPTION_ERROR_INVALID_ARGUMENT,
+    CONSTRAINT_ERROR_INVALID_FILE,
+    CONSTRAINT_ERROR_UNSATISFIED,
+    WEIGHTS_ERROR_INVALID_FILE,
+    LAYOUT_ERROR_UNSCORED_CHARS,
+};
+
+std::string_view error_message(Error error);
+
+enum class Finger : std::uint8_t {
+    LP = 0,
+    LR = 1,
+    LM = 2,
+    LI = 3,
+    LT = 4,
+    RT = 5,
+    RI = 6,
+    RM = 7,
+    RR = 8,
+    RP = 9,
+    TB = 10,
+};
+
+enum class Hand : std::uint8_t {
+    LEFT = 0,
+    RIGHT = 1,
+};
+
+struct Key {
+    char value = '\0';
+    int row;
+    int column;
+    Finger finger;
+    Hand hand;
+};
+
+struct KeyboardLayout {
+    std::string name;
+    std::unordered_map<char, Key> char_to_key;
+    std::array<std::array<Key, 10>, 4> matrix;
+    std::unordered_set<char> valid_keys;
+
+    double score = 0;
+
+    void print() {
+        std::cout << name << ": \n\n"; 
+
+        for (int row = 0; row < 4; row++) {
+            for (int col = 0; col < 10; col++) {
+                std::cout << matrix[row][col].value << " ";
+            }
+            std::cout << "\n";
+        }
+        std::cout << "Score:" << score << "\n";
+    }
+};
+
+std::expected<KeyboardLayout, Error> load_layout_file(const std::filesystem::path &layout_file);
+std::expected<KeyboardLayout, Error> load_layout(const std::string &file);
+
+// Characters the n-gram tables are kept for. Anything else in the corpus,
+// including space, breaks n-grams.
+constexpr std::size_t ALPHABET_SIZE = 32;
+constexpr std::uint8_t NO_CHAR = 0xFF;
+constexpr std::string_view DEFAULT_ALPHABET = "abcdefghijklmnopqrstuvwxyz,./;'";
+
+struct Alphabet {
+    std::array<std::uint8_t, 256> ids;
+    std::array<char, ALPHABET_SIZE> chars{};
+    std::uint8_t size = 0;
+
+    std::uint8_t id(char ch) const { return ids[static_cast<unsigned char>(ch)]; }
+};
+
+std::string alpha_chars(const KeyboardLayout &layout);
+Alphabet layout_alphabet(std::string_view placed);
+std::string unscored_chars(const KeyboardLayout &layout, const Alphabet &alphabet);
+
+constexpr std::size_t bigram_index(std::size_t a, std::size_t b) {
+    return a * ALPHABET_SIZE + b;
+}
+
+constexpr std::size_t trigram_index(std::size_t a, std::size_t b, std::size_t c) {
+    return (a * ALPHABET_SIZE + b) * ALPHABET_SIZE + c;
+}
+
+// Dense n-gram counts of a corpus, indexed by compact character id. Built once,
+// after which evaluating a layout no longer depends on the corpus size.
+struct NgramTables {
+    Alphabet alphabet;
+    std::array<std::uint64_t, ALPHABET_SIZE> monograms{};
+    std::array<std::uint64_t, ALPHABET_SIZE * ALPHABET_SIZE> bigrams{};
+    std::array<std::uint64_t, ALPHABET_SIZE * ALPHABET_SIZE * ALPHABET_SIZE> trigrams{};
+};
+
+std::unique_ptr<NgramTables> build_ngram_tables(std::string_view corpus, const Alphabet &alphabet);
+std::expected<void, Error> write_corpus(const std::string &file, const NgramTables &tables);
+
+// A compiled corpus mapped into memory; tables points into the mapping.
+struct MappedCorpus {
+    void *data = MAP_FAILED;
+    std::size_t size = 0;
+    const NgramTables *tables = nullptr;
+
+    ~MappedCorpus() {
+        if (data != MAP_FAILED) munmap(data, size);
+    }
+};
+
+std::expected<std::unique_ptr<MappedCorpus>, Error> map_corpus(const std::string &file);
+
+// Alpha keys are the first three rows of the matrix, numbered row * 10 + column.
+// The thumb row only ever holds space, which is not part of the alphabet.
+constexpr std::size_t KEY_COUNT = 30;
+constexpr std::uint8_t NO_POSITION = 0xFF;
+
+constexpr std::size_t pair_index(std::size_t p, std::size_t q) {
+    return p * KEY_COUNT + q;
+}
+
+constexpr std::size_t triple_index(std::size_t p, std::size_t q, std::size_t r) {
+    return (p * KEY_COUNT + q) * KEY_COUNT + r;
+}
+
+enum class Trigram : std::uint8_t {
+    OTHER,
+    ALTERNATE,
+    ROLL_IN,
+    ROLL_OUT,
+    ONEH_IN,
+    ONEH_OUT,
+    REDIRECT,
+    BAD_REDIRECT,
+    DSFB_RED,
+    DSFB_ALT,
+    COUNT,
+};
+
+// Key positions and their pair and triple classifications. Every metric is a
+// function of where characters sit, so scoring a layout is a sum of n-gram
+// counts times these entries (a quadratic assignment problem).
+struct Geometry {
+    std::array<Key, KEY_COUNT> keys;
+    std::array<std::uint8_t, KEY_COUNT * KEY_COUNT> same_finger{};
+    std::array<Trigram, KEY_COUNT * KEY_COUNT * KEY_COUNT> trigrams{};
+    // The key in the mirror image position on the other hand, which
+    // get_finger gives the matching finger.
+    std::array<std::uint8_t, KEY_COUNT> mirror{};
+};
+
+Geometry build_geometry();
+
+extern const Geometry geometry;
+
+// A layout as a permutation: the key position of every alphabet character, or
+// NO_POSITION if the layout does not have it.
+using Positions = std::array<std::uint8_t, ALPHABET_SIZE>;
+
+// A layout reduced to the permutation the optimizers work on: the character id
+// on every alpha key and the key of every character id. Trivially copyable and
+// within a cache line, so copying a layout is a short memcpy. Optimizers that
+// need its Zobrist hash keep it next to the layout.
+struct CompactLayout {
+    std::array<std::uint8_t, KEY_COUNT> keys;
+    Positions positions;
+};
+
+static_assert(std::is_trivially_copyable_v<CompactLayout>);
+static_assert(sizeof(CompactLayout) <= 64);
+
+CompactLayout to_compact(const KeyboardLayout &layout, const Alphabet &alphabet);
+void apply_layout(KeyboardLayout &layout, const CompactLayout &compact, const Alphabet &alphabet);
+
+// Where each character may go, compiled to one mask per key: bit id of
+// allowed[pos] is set if character id may sit on key pos. A swap is legal if
+// both characters may take the other's key, two bit tests in a search loop.
+struct Constraints {
+    std::array<std::uint32_t, KEY_COUNT> allowed = [] {
+        std::array<std::uint32_t, KEY_COUNT> all;
+        all.fill(~0u);
+        return all;
+    }();
+
+    bool allows(std::uint8_t id, std::uint8_t pos) const { return (allowed[pos] >> id) & 1; }
+
+    bool unconstrained() const {
+        return std::all_of(allowed.begin(), allowed.end(), [](std::uint32_t mask) { return mask == ~0u; });
+    }
+};
+
+extern const Constraints UNCONSTRAINED;
+
+struct LayoutStats {
+    double alternate = 0.0;
+    double roll_in = 0.0;
+    double roll_out = 0.0;
+    double oneh_in = 0.0;
+    double oneh_out = 0.0;
+    double redirect = 0.0;
+    double bad_redirect = 0.0;
+    double sfb = 0.0;
+    double dsfb_red = 0.0;
+    double dsfb_alt = 0.0;
+    double left_hand = 0.0;
+    double right_hand = 0.0;
+
+    void print() const {
+        std::ios_base::fmtflags flags = std::cout.flags();
+        std::streamsize precision = std::cout.precision();
+
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << "  Alt: " << alternate << "%\n";
+        std::cout << "  Rol: " << roll_in + roll_out << "%   (In/Out: "
+                  << roll_in << "% | " << roll_out << "%)\n";
+        std::cout << "  One: " << oneh_in + oneh_out << "%   (In/Out: "
+                  << oneh_in << "% | " << oneh_out << "%)\n";
+        std::cout << "  Red: " << redirect + bad_redirect << "%   (Bad: "
+                  << bad_redirect << "%)\n";
+        std::cout << "\n  SFB: " << sfb << "%\n";
+        std::cout << "  SFS: " << (dsfb_red + dsfb_alt) << "%   (Red/Alt: "
+                  << dsfb_red << "% | " << dsfb_alt << "%)\n";
+        std::cout << "\n  LH/RH: " << left_hand << "% | " << right_hand << "%\n";
+
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+    }
+};
+
+// Weight of every LayoutStats metric in the score, which is their weighted
+// sum. Lower scores are better, so metrics to encourage get negative weights.
+struct Weights {
+    double alternate = 0;
+    double roll_in = 0;
+    double roll_out = 0;
+    double oneh_in = 0;
+    double oneh_out = 0;
+    double redirect = 0;
+    double bad_redirect = 0;
+    double sfb = 1;
+    double dsfb_red = 0;
+    double dsfb_alt = 0;
+    double left_hand = 0;
+    double right_hand = 0;
+};
+
+// The weights folded into per-key costs, so a score is one pass per n-gram
+// order however many metrics are weighted: pair_cost for a bigram on two
+// keys, key_cost for a monogram on one, triple_cost for a trigram on three.
+// A cost times count * 100 / total of its n-gram order adds up to the
+// weighted percentages. Orders with no weighted metric are skipped.
+struct ScoreKernel {
+    Weights weights;
+    std::array<double, KEY_COUNT * KEY_COUNT> pair_cost{};
+    std::array<double, KEY_COUNT> key_cost{};
+    std::array<double, KEY_COUNT * KEY_COUNT * KEY_COUNT> triple_cost{};
+    bool uses_keys = false;
+    bool uses_trigrams = false;
+};
+
+ScoreKernel make_kernel(const Weights &weights);
+
+extern ScoreKernel scoring;
+
+enum class Dedupe : std::uint8_t {
+    NONE,
+    MIRROR,  // a layout and its hand mirror are the same
+    FINGERS, // also layouts with the same characters sharing each finger
+};
+
+// The denominators of a layout's percentages: n-grams made only of placed
+// characters. A swap of two placed characters does not change them.
+struct PlacedTotals {
+    double monograms = 0;
+    double bigrams = 0;
+    double trigrams = 0; // only counted when the scoring kernel uses trigrams
+};
+
+PlacedTotals placed_totals(const Positions &positions, const NgramTables &tables);
+double score_layout(const Positions &positions, const NgramTables &tables);
+
+// Metrics an Evaluator can compute, named after the LayoutStats fields they fill.
+struct SFB {};
+struct SFS {}; // dsfb_red and dsfb_alt
+struct Alternates {};
+struct Rolls {};    // roll_in and roll_out
+struct OneHands {}; // oneh_in and oneh_out
+struct Redirects {}; // redirect and bad_redirect
+struct HandBalance {}; // left_hand and right_hand
+
+template <typename Metric>
+constexpr bool counts_trigram(Trigram type) {
+    if constexpr (std::is_same_v<Metric, SFS>) return type == Trigram::DSFB_RED || type == Trigram::DSFB_ALT;
+    else if constexpr (std::is_same_v<Metric, Alternates>) return type == Trigram::ALTERNATE;
+    else if constexpr (std::is_same_v<Metric, Rolls>) return type == Trigram::ROLL_IN || type == Trigram::ROLL_OUT;
+    else if constexpr (std::is_same_v<Metric, OneHands>) return type == Trigram::ONEH_IN || type == Trigram::ONEH_OUT;
+    else if constexpr (std::is_same_v<Metric, Redirects>) return type == Trigram::REDIRECT || type == Trigram::BAD_REDIRECT;
+    else return false;
+}
+
+// Computes the LayoutStats fields of a compile-time set of metrics and leaves
+// the rest at zero. Each n-gram order is only walked if a selected metric
+// needs it, and the trigram pass keeps one accumulator per selected class:
+// SLOTS sends every other class to one spare slot that is never read, so the
+// inner loop has no branch on the class.
+template <typename... Metrics>
+struct Evaluator {
+    template <typename Metric>
+    static constexpr bool HAS = (std::is_same_v<Metric, Metrics> || ...);
+
+    static constexpr std::size_t CLASSES = static_cast<std::size_t>(Trigram::COUNT);
+
+    static constexpr bool counts(std::size_t type) {
+        return (counts_trigram<Metrics>(static_cast<Trigram>(type)) || ...);
+    }
+
+    static constexpr std::size_t COUNTED = [] {
+        std::size_t counted = 0;
+        for (std::size_t type = 0; type < CLASSES; type++) counted += counts(type);
+        return counted;
+    }();
+
+    static constexpr std::array<std::uint8_t, CLASSES> SLOTS = [] {
+        std::array<std::uint8_t, CLASSES> slots{};
+        std::uint8_t next = 0;
+        for (std::size_t type = 0; type < CLASSES; type++) slots[type] = counts(type) ? next++ : COUNTED;
+        return slots;
+    }();
+
+    static LayoutStats evaluate(const Positions &positions, const NgramTables &tables);
+};
+
+template <typename... Metrics>
+LayoutStats Evaluator<Metrics...>::evaluate(const Positions &positions, const NgramTables &tables) {
+    const std::size_t size = tables.alphabet.size;
+    LayoutStats stats;
+
+    if constexpr (HAS<HandBalance>) {
+        double left = 0, right = 0;
+        for (std::size_t id = 0; id < size; id++) {
+            std::uint8_t p = positions[id];
+            if (p == NO_POSITION) continue;
+
+            (geometry.keys[p].hand == Hand::LEFT ? left : right) += tables.monograms[id];
+        }
+        if (left + right > 0) {
+            stats.left_hand = (left * 100) / (left + right);
+            stats.right_hand = (right * 100) / (left + right);
+        }
+    }
+
+    if constexpr (HAS<SFB>) {
+        double sfb = 0;
+        double total = 0;
+
+        for (std::size_t first = 0; first < size; ++first) {
+            std::uint8_t p = positions[first];
+            if (p == NO_POSITION) continue;
+
+            for (std::size_t second = 0; second < size; ++second) {
+                std::uint8_t q = positions[second];
+                if (q == NO_POSITION) continue;
+
+                double count = tables.bigrams[bigram_index(first, second)];
+                total += count;
+                sfb += count * geometry.same_finger[pair_index(p, q)];
+            }
+        }
+        if (total > 0) stats.sfb = (sfb * 100) / total;
+    }
+
+    if constexpr (COUNTED > 0) {
+        std::array<double, COUNTED + 1> counts{};
+        double total_trigrams = 0;
+
+        for (std::size_t first = 0; first < size; ++first) {
+            std::uint8_t p = positions[first];
+            if (p == NO_POSITION) continue;
+
+            for (std::size_t second = 0; second < size; ++second) {
+                std::uint8_t q = positions[second];
+                if (q == NO_POSITION) continue;
+
+                for (std::size_t third = 0; third < size; ++third) {
+                    std::uint8_t r = positions[third];
+                    if (r == NO_POSITION) continue;
+
+                    double count = tables.trigrams[trigram_index(first, second, third)];
+                    total_trigrams += count;
+                    counts[SLOTS[static_cast<std::size_t>(geometry.trigrams[triple_index(p, q, r)])]] += count;
+                }
+            }
+        }
+
+        if (total_trigrams > 0) {
+            auto percent = [&](Trigram type) {
+                return (counts[SLOTS[static_cast<std::size_t>(type)]] / total_trigrams) * 100;
+            };
+            if constexpr (HAS<Alternates>) stats.alternate = percent(Trigram::ALTERNATE);
+            if constexpr (HAS<Rolls>) {
+                stats.roll_in = percent(Trigram::ROLL_IN);
+                stats.roll_out = percent(Trigram::ROLL_OUT);
+            }
+            if constexpr (HAS<OneHands>) {
+                stats.oneh_in = percent(Trigram::ONEH_IN);
+                stats.oneh_out = percent(Trigram::ONEH_OUT);
+            }
+            if constexpr (HAS<Redirects>) {
+                stats.redirect = percent(Trigram::REDIRECT);
+                stats.bad_redirect = percent(Trigram::BAD_REDIRECT);
+            }
+            if constexpr (HAS<SFS>) {
+                stats.dsfb_red = percent(Trigram::DSFB_RED);
+                stats.dsfb_alt = percent(Trigram::DSFB_ALT);
+            }
+        }
+    }
+
+    return stats;
+}
+
+// The two sets the program uses: the optimizers' default score and the full
+// report.
+using SfbEvaluator = Evaluator<SFB>;
+using StatsEvaluator = Evaluator<SFB, SFS, Alternates, Rolls, OneHands, Redirects, HandBalance>;
+extern template struct Evaluator<SFB>;
+extern template struct Evaluator<SFB, SFS, Alternates, Rolls, OneHands, Redirects, HandBalance>;
+
+double get_sfb(const Positions &positions, const NgramTables &tables);
+LayoutStats get_stats(const Positions &positions, const NgramTables &tables);
+LayoutStats get_stats(KeyboardLayout &layout, const NgramTables &tables);
+void swap_keys(KeyboardLayout &layout, char char1, char char2);
+void swap_keys(CompactLayout &layout, std::uint8_t id1, std::uint8_t id2);
+double swap_delta(const Positions &positions, const NgramTables &tables, const PlacedTotals &totals,
+                  std::uint8_t id1, std::uint8_t id2);
+KeyboardLayout gen_layout(KeyboardLayout layout, const NgramTables &tables,
+                          const Constraints &constraints = UNCONSTRAINED);
+
+struct CacheStats {
+    std::uint64_t lookups = 0;
+    std::uint64_t hits = 0;
+};
+
+// Fixed-size table of layout scores keyed by Zobrist hash, shared by optimizer
+// threads without locks. A slot holds the score bits and the hash XOR those
+// bits; a slot torn by two threads storing at once fails that check and reads
+// as a miss. Newer entries overwrite older ones in the same slot, and full
+// 64-bit hash collisions are not guarded against.
+//
+// Threads count their lookups in a local CacheStats and merge it once at the
+// end, so the counters do not bounce between cores.
+struct ScoreCache {
+    struct Slot {
+        std::atomic<std::uint64_t> check{0};
+        std::atomic<std::uint64_t> bits{0};
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask = 0;
+    std::atomic<std::uint64_t> lookups{0};
+    std::atomic<std::uint64_t> hits{0};
+
+    // capacity is rounded up to a power of two
+    explicit ScoreCache(std::size_t capacity)
+        : slots(std::make_unique<Slot[]>(std::bit_ceil(std::max<std::size_t>(capacity, 1)))),
+          mask(std::bit_ceil(std::max<std::size_t>(capacity, 1)) - 1) {}
+
+    std::optional<double> find(std::uint64_t hash, CacheStats &stats) const {
+        const Slot &slot = slots[hash & mask];
+        std::uint64_t bits = slot.bits.load(std::memory_order_relaxed);
+        std::uint64_t check = slot.check.load(std::memory_order_relaxed);
+
+        stats.lookups++;
+        if ((check ^ bits) != hash || hash == 0) return std::nullopt;
+        stats.hits++;
+        return std::bit_cast<double>(bits);
+    }
+
+    void store(std::uint64_t hash, double score) {
+        Slot &slot = slots[hash & mask];
+        std::uint64_t bits = std::bit_cast<std::uint64_t>(score);
+        slot.bits.store(bits, std::memory_order_relaxed);
+        slot.check.store(hash ^ bits, std::memory_order_relaxed);
+    }
+
+    void merge(const CacheStats &stats) {
+        lookups.fetch_add(stats.lookups, std::memory_order_relaxed);
+        hits.fetch_add(stats.hits, std::memory_order_relaxed);
+    }
+
+    std::size_t capacity() const { return mask + 1; }
+};
+
+void print_cache_stats(const ScoreCache &cache);
+
+enum class Schedule : std::uint8_t {
+    EXPONENTIAL,
+    LINEAR,
+    NONE, // zero temperature, a plain hill climb
+};
+
+struct AnnealConfig {
+    double start_temperature = 0.5;
+    double end_temperature = 0.001;
+    Schedule schedule = Schedule::EXPONENTIAL;
+    std::uint64_t iterations = 10'000'000;
+    double time_limit = 0; // seconds, replaces the iteration budget when set
+    std::uint64_t seed = 0;
+};
+
+std::vector<std::uint8_t> movable_ids(const Positions &positions, const Alphabet &alphabet);
+
+struct ChainResult {
+    CompactLayout layout;
+    double score;
+};
+
+KeyboardLayout anneal_layout(KeyboardLayout layout, const NgramTables &tables, const AnnealConfig &config,
+                             const Constraints &constraints = UNCONSTRAINED, ScoreCache *cache = nullptr);
+
+struct TabuConfig {
+    std::uint64_t iterations = 100'000;
+    double time_limit = 0; // seconds, replaces the iteration budget when set
+    std::uint64_t seed = 0;
+    std::size_t tenure = 0;       // 0 uses the number of movable characters
+    std::uint64_t aspiration = 0; // 0 uses 5 n^2 iterations
+};
+
+// The delta of every swap between two movable characters. The bigram part of
+// the score is a quadratic assignment: the bigram flow between two characters
+// times the pair cost of their keys; key costs add a linear term. After a
+// swap, deltas of pairs disjoint from it are updated in O(1) and only the
+// 2n - 3 pairs sharing a moved character are recomputed. Deltas are kept in
+// raw bigram counts, which stay exact in a double for the default weights;
+// scale turns them into score. Everything is indexed by position in movable;
+// n <= KEY_COUNT.
+//
+// Trigram costs are not quadratic, so when the kernel uses them every delta
+// is recomputed with swap_delta after each swap instead.
+//
+// delta[r][s] holds the swap of r and s for r < s < n. Every other entry is
+// +infinity, so the matrix can also be scanned as one flat buffer.
+struct SwapTable {
+    using Matrix = std::array<std::array<double, KEY_COUNT>, KEY_COUNT>;
+
+    std::size_t n = 0;
+    std::array<std::uint8_t, KEY_COUNT> place{};
+    std::array<std::uint8_t, KEY_COUNT> ids{};
+    Matrix flow{};
+    std::array<double, KEY_COUNT> key_flow{}; // monogram counts in bigram units
+    Matrix cost;
+    Matrix delta;
+    double scale = 0;
+
+    // only read for trigram costs
+    const NgramTables *tables = nullptr;
+    Positions positions{};
+    PlacedTotals totals;
+
+    double dist(std::size_t i, std::size_t j) const { return cost[place[i]][place[j]]; }
+
+    double full_delta(std::size_t r, std::size_t s) const {
+        if (scoring.uses_trigrams) return swap_delta(positions, *tables, totals, ids[r], ids[s]) / scale;
+
+        double result = (key_flow[r] - key_flow[s]) * (scoring.key_cost[place[s]] - scoring.key_cost[place[r]]);
+        for (std::size_t k = 0; k < n; k++) {
+            if (k == r || k == s) continue;
+            result += (flow[r][k] - flow[s][k]) * (dist(s, k) - dist(r, k));
+        }
+        return result;
+    }
+
+    // Swaps the keys of r and s and brings every delta up to date.
+    void swap(std::size_t r, std::size_t s) {
+        std::swap(place[r], place[s]);
+        std::swap(positions[ids[r]], positions[ids[s]]);
+
+        for (std::size_t i = 0; i < n; i++) {
+            for (std::size_t j = i + 1; j < n; j++) {
+                if (scoring.uses_trigrams || i == r || i == s || j == r || j == s) {
+                    delta[i][j] = full_delta(i, j);
+                } else {
+                    delta[i][j] += (flow[i][r] - flow[i][s] + flow[j][s] - flow[j][r]) *
+                                   (dist(j, r) - dist(i, r) + dist(i, s) - dist(j, s));
+                }
+            }
+        }
+    }
+};
+
+SwapTable make_swap_table(const CompactLayout &layout, const std::vector<std::uint8_t> &movable,
+                          const NgramTables &tables);
+KeyboardLayout tabu_layout(KeyboardLayout layout, const NgramTables &tables, const TabuConfig &config,
+                           const Constraints &constraints = UNCONSTRAINED);
+ChainResult descend(CompactLayout layout, const NgramTables &tables,
+                    const Constraints &constraints = UNCONSTRAINED);
+KeyboardLayout steepest_layout(KeyboardLayout layout, const NgramTables &tables,
+                               const Constraints &constraints = UNCONSTRAINED);
+
+enum class Crossover : std::uint8_t {
+    PMX, // partially mapped
+    OX,  // order
+};
+
+struct GeneticConfig {
+    std::size_t population = 1000;
+    std::uint64_t generations = 500;
+    double time_limit = 0; // seconds, replaces the generation budget when set
+    std::uint64_t seed = 0;
+    std::size_t tournament = 3;
+    double mutation = 0.2; // chance of one random swap per child
+    Crossover crossover = Crossover::PMX;
+    std::size_t threads = 0; // 0 uses every hardware thread
+};
+
+KeyboardLayout genetic_layout(KeyboardLayout layout, const NgramTables &tables, const GeneticConfig &config,
+                              const Constraints &constraints = UNCONSTRAINED, ScoreCache *cache = nullptr);
+
+struct ExactConfig {
+    std::string chars; // characters to place, the most frequent ones if empty
+    std::string keys;  // keys to place them on, named by their current characters; home row if empty
+};
+
+struct ExactResult {
+    ChainResult best;
+    std::uint64_t nodes = 0;
+};
+
+std::expected<ExactResult, Error> exact_search(CompactLayout layout, const NgramTables &tables,
+                                               const ExactConfig &config,
+                                               const Constraints &constraints = UNCONSTRAINED);
+
+struct ParallelConfig {
+    std::size_t chains = 0;  // 0 runs one chain per thread
+    std::size_t threads = 0; // 0 uses every hardware thread
+    std::size_t top = 5;
+    Dedupe dedupe = Dedupe::NONE; // layouts the top list and batch treat as one
+};
+
+std::vector<KeyboardLayout> parallel_layouts(const KeyboardLayout &layout, const NgramTables &tables,
+                                             const AnnealConfig &anneal, const ParallelConfig &config,
+                                             const Constraints &constraints = UNCONSTRAINED,
+                                             ScoreCache *cache = nullptr);
+
+struct Options {
+    std::string layout = "semimak";
+    std::string corpus = "mt-quotes";
+    std::string text; // raw text file or directory, used instead of corpus
+    std::string mode = "greedy";
+    std::string socket = "/tmp/liu.sock";
+    std::string constraints; // constraint file, none if empty
+    std::string weights;     // weights file, SFB only if empty
+    std::size_t cache = 0;   // score cache slots, 0 disables the cache
+    AnnealConfig anneal;
+    TabuConfig tabu;
+    GeneticConfig genetic;
+    ExactConfig exact;
+    ParallelConfig parallel;
+};
+
+template <typename T>
+bool parse_number(std::string_view text, T &value) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+std::expected<Options, Error> parse_options(int argc, char **argv);
+std::expected<Constraints, Error> load_constraints(const std::filesystem::path &file, const CompactLayout &layout,
+                                                   const Alphabet &alphabet);
+std::expected<Weights, Error> load_weights(const std::filesystem::path &file);
+bool use_weights(const Options &options);
+std::expected<std::size_t, Error> repair_layout(CompactLayout &layout, const Constraints &constraints,
+                                                const Alphabet &alphabet);
+void print_usage();
+int compile_corpus(int argc, char **argv);
+
+// The corpus selected by the options: raw text is counted on the spot,
+// otherwise the compiled corpus is mapped.
+struct LoadedCorpus {
+    std::unique_ptr<NgramTables> counted;
+    std::unique_ptr<MappedCorpus> mapped;
+    const NgramTables *tables = nullptr;
+};
+
+std::optional<LoadedCorpus> load_corpus(const Options &options, std::string_view placed = {});
+int batch_command(int argc, char **argv);
+
+// Wire format of liu serve, native byte order. A client writes ServeRequest
+// frames and reads one ServeResponse back for each.
+enum ServeOp : std::uint8_t {
+    SERVE_OP_EVALUATE = 1,
+};
+
+enum ServeStatus : std::uint8_t {
+    SERVE_STATUS_OK = 0,
+    SERVE_STATUS_BAD_REQUEST = 1,
+};
+
+struct ServeRequest {
+    std::uint8_t op;
+    std::uint8_t reserved;
+    std::array<char, KEY_COUNT> keys; // row-major alpha keys, '\0' when empty
+};
+
+struct ServeResponse {
+    std::uint8_t status = SERVE_STATUS_BAD_REQUEST;
+    std::array<std::uint8_t, 7> reserved{};
+    double score = 0;
+    LayoutStats stats;
+};
+
+static_assert(sizeof(ServeRequest) == 32);
+static_assert(std::is_trivially_copyable_v<ServeResponse>);
+
+ServeResponse serve_request(const ServeRequest &request, const NgramTables &tables);
+int serve_command(int argc, char **argv);